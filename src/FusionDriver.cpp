@@ -0,0 +1,321 @@
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+/* Defined in FusionPass.cpp, which is linked into the driver */
+PassPluginLibraryInfo getFusionPassPluginInfo(void);
+
+namespace {
+
+cl::opt<std::string> InputFilename(
+	cl::Positional,
+	cl::desc("<input bitcode or IR>"),
+	cl::init("-"));
+
+cl::opt<std::string> OutputFilename(
+	"o",
+	cl::desc("Output filename"),
+	cl::value_desc("filename"),
+	cl::init("-"));
+
+cl::opt<bool> OutputAssembly(
+	"S",
+	cl::desc("Write textual IR instead of bitcode"));
+
+/* 0 uses every core */
+cl::opt<unsigned> Threads(
+	"j",
+	cl::desc("Number of worker threads"),
+	cl::init(0));
+
+/* Several chunks per thread even out functions of very different size */
+cl::opt<unsigned> ChunksPerThread(
+	"chunks-per-thread",
+	cl::desc("Number of module partitions per worker thread"),
+	cl::init(4));
+
+/* A partition of the module, passed between contexts as bitcode */
+struct Chunk
+{
+	SmallVector<char, 0> Bitcode;
+	std::string Error;
+};
+
+void
+writeBitcode(const Module &M, SmallVectorImpl<char> &Buffer)
+{
+	Buffer.clear();
+	raw_svector_ostream OS(Buffer);
+	WriteBitcodeToFile(M, OS);
+} /* writeBitcode */
+
+Expected<std::unique_ptr<Module>>
+readBitcode(const Chunk &C, LLVMContext &Context)
+{
+	MemoryBufferRef Buffer(StringRef(C.Bitcode.data(), C.Bitcode.size()), "chunk");
+	return (parseBitcodeFile(Buffer, Context));
+} /* readBitcode */
+
+/* Runs on a worker thread, everything it creates belongs to its own context */
+void
+fuseChunk(Chunk &C)
+{
+	LLVMContext Context;
+	Expected<std::unique_ptr<Module>> M = readBitcode(C, Context);
+	if (!M)
+	{
+		C.Error = toString(M.takeError());
+		return;
+	}
+
+	/* Same target as opt would pick, so TTI based costs match the plugin */
+	std::unique_ptr<TargetMachine> TM;
+	std::string TargetError;
+	if (const Target *T = TargetRegistry::lookupTarget((*M)->getTargetTriple(), TargetError))
+	{
+		TM.reset(T->createTargetMachine((*M)->getTargetTriple(), "", "", TargetOptions(), std::nullopt));
+	}
+
+	LoopAnalysisManager LAM;
+	FunctionAnalysisManager FAM;
+	CGSCCAnalysisManager CGAM;
+	ModuleAnalysisManager MAM;
+	PassBuilder PB(TM.get());
+	getFusionPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+	PB.registerModuleAnalyses(MAM);
+	PB.registerCGSCCAnalyses(CGAM);
+	PB.registerFunctionAnalyses(FAM);
+	PB.registerLoopAnalyses(LAM);
+	PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+	ModulePassManager MPM;
+	if (Error E = PB.parsePassPipeline(MPM, "function(fusion-pass)"))
+	{
+		C.Error = toString(std::move(E));
+		return;
+	}
+	MPM.run(**M, MAM);
+	writeBitcode(**M, C.Bitcode);
+} /* fuseChunk */
+
+/* Every chunk carries the named metadata of the module and the linker appends all copies in chunk order, so operand I
+   of a later chunk is a copy of operand I % Count of the first one. Copies of uniqued nodes are the same node. Copies
+   of distinct ones, like the DICompileUnit of llvm.dbg.cu, are not: their users are moved to the first copy */
+void
+removeDuplicateNamedMetadata(Module &M, const StringMap<unsigned> &ChunkOperands)
+{
+	ValueToValueMapTy VMap;
+	for (NamedMDNode &NMD : M.named_metadata())
+	{
+		unsigned Count = ChunkOperands.lookup(NMD.getName());
+		if (Count == 0 || NMD.getNumOperands() % Count != 0)
+		{
+			continue;
+		}
+		for (unsigned I = Count; I < NMD.getNumOperands(); I++)
+		{
+			MDNode *Copy = NMD.getOperand(I);
+			MDNode *Original = NMD.getOperand(I % Count);
+			if (Copy != Original && Copy->isDistinct())
+			{
+				VMap.MD()[Copy].reset(Original);
+			}
+		}
+	}
+
+	/* Distinct users such as subprograms are changed in place, uniqued ones are rebuilt */
+	if (!VMap.MD().empty())
+	{
+		ValueMapper Mapper(VMap, RF_IgnoreMissingLocals | RF_ReuseAndMutateDistinctMDs);
+		for (Function &F : M)
+		{
+			Mapper.remapFunction(F);
+		}
+		for (GlobalVariable &GV : M.globals())
+		{
+			SmallVector<std::pair<unsigned, MDNode *>, 1> Attachments;
+			GV.getAllMetadata(Attachments);
+			GV.clearMetadata();
+			for (auto &[Kind, N] : Attachments)
+			{
+				GV.addMetadata(Kind, *Mapper.mapMDNode(*N));
+			}
+		}
+	}
+
+	for (NamedMDNode &NMD : M.named_metadata())
+	{
+		SmallVector<MDNode *, 8> Unique;
+		SmallPtrSet<MDNode *, 8> Seen;
+		for (MDNode *N : NMD.operands())
+		{
+			if (std::optional<Metadata *> Mapped = VMap.getMappedMD(N))
+			{
+				N = cast<MDNode>(*Mapped);
+			}
+			if (Seen.insert(N).second)
+			{
+				Unique.push_back(N);
+			}
+		}
+		if (Unique.size() == NMD.getNumOperands())
+		{
+			continue;
+		}
+		NMD.clearOperands();
+		for (MDNode *N : Unique)
+		{
+			NMD.addOperand(N);
+		}
+	}
+} /* removeDuplicateNamedMetadata */
+
+} /* namespace */
+
+int
+main(int argc, char **argv)
+{
+	InitLLVM X(argc, argv);
+	InitializeAllTargets();
+	InitializeAllTargetMCs();
+	cl::ParseCommandLineOptions(argc, argv, "runs fusion-pass on partitions of a module in parallel\n");
+
+	/* Pass timers are shared by name, concurrent chunks would race on them */
+	if (TimePassesIsEnabled && Threads != 1)
+	{
+		WithColor::error(errs(), argv[0]) << "-time-passes needs -j=1\n";
+		return (1);
+	}
+
+	LLVMContext Context;
+	SMDiagnostic Diag;
+	std::unique_ptr<Module> M = parseIRFile(InputFilename, Diag, Context);
+	if (!M)
+	{
+		Diag.print(argv[0], errs());
+		return (1);
+	}
+	if (verifyModule(*M, &errs()))
+	{
+		WithColor::error(errs(), argv[0]) << InputFilename << ": input module is broken\n";
+		return (1);
+	}
+
+	ThreadPoolStrategy Strategy = hardware_concurrency(Threads);
+	unsigned NumChunks = std::max(1u, Strategy.compute_thread_count() * ChunksPerThread);
+
+	/* Locals go to the chunk of their users, so no linkage changes and the chunks link back as they are */
+	std::vector<Chunk> Chunks;
+	SplitModule(
+		*M,
+		NumChunks,
+		[&Chunks](std::unique_ptr<Module> Part)
+		{
+			Chunks.emplace_back();
+			writeBitcode(*Part, Chunks.back().Bitcode);
+		},
+		/* PreserveLocals */ true);
+
+	/* Every chunk has a copy of module level asm, it is put back once after linking */
+	std::string ModuleAsm = M->getModuleInlineAsm();
+	std::string ModuleID = M->getModuleIdentifier();
+	M.reset();
+
+	{
+		DefaultThreadPool Pool(Strategy);
+		for (Chunk &C : Chunks)
+		{
+			Pool.async([&C]() { fuseChunk(C); });
+		}
+		Pool.wait();
+	}
+
+	std::unique_ptr<Module> Result;
+	StringMap<unsigned> ChunkOperands;
+	for (Chunk &C : Chunks)
+	{
+		if (!C.Error.empty())
+		{
+			WithColor::error(errs(), argv[0]) << C.Error << "\n";
+			return (1);
+		}
+		Expected<std::unique_ptr<Module>> Part = readBitcode(C, Context);
+		if (!Part)
+		{
+			WithColor::error(errs(), argv[0]) << toString(Part.takeError()) << "\n";
+			return (1);
+		}
+		C.Bitcode.clear();
+		(*Part)->setModuleInlineAsm("");
+		if (!Result)
+		{
+			Result = std::move(*Part);
+			for (const NamedMDNode &NMD : Result->named_metadata())
+			{
+				ChunkOperands[NMD.getName()] = NMD.getNumOperands();
+			}
+		}
+		else if (Linker::linkModules(*Result, std::move(*Part)))
+		{
+			WithColor::error(errs(), argv[0]) << "cannot link fused chunks\n";
+			return (1);
+		}
+	}
+	Result->setModuleIdentifier(ModuleID);
+	Result->setModuleInlineAsm(ModuleAsm);
+	removeDuplicateNamedMetadata(*Result, ChunkOperands);
+	if (verifyModule(*Result, &errs()))
+	{
+		WithColor::error(errs(), argv[0]) << "fused module is broken\n";
+		return (1);
+	}
+
+	std::error_code EC;
+	ToolOutputFile Out(OutputFilename, EC, OutputAssembly ? sys::fs::OF_Text : sys::fs::OF_None);
+	if (EC)
+	{
+		WithColor::error(errs(), argv[0]) << OutputFilename << ": " << EC.message() << "\n";
+		return (1);
+	}
+	if (OutputAssembly)
+	{
+		Result->print(Out.os(), nullptr);
+	}
+	else
+	{
+		WriteBitcodeToFile(*Result, Out.os());
+	}
+	Out.keep();
+	return (0);
+} /* main */
@@ -1,12 +1,55 @@
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/IVDescriptors.h"
+#include "llvm/Analysis/LoopAccessAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopIterator.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+
+#include <memory>
+#include <optional>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "fusion-pass"
+
+STATISTIC(NumCandidates, "Number of loops found to be fusion candidates");
+STATISTIC(NumCFESets, "Number of control flow equivalent sets of candidates");
+STATISTIC(NumPairsTried, "Number of loop pairs considered for fusion");
+STATISTIC(NumFusions, "Number of loop pairs fused");
+STATISTIC(NumPairsRefused, "Number of loop pairs left unfused");
+STATISTIC(NumDepQueries, "Number of DependenceInfo queries issued");
+STATISTIC(NumDepQueriesPruned, "Number of memory access pairs pruned before DependenceInfo");
+STATISTIC(NumDepBudgetsExceeded, "Number of loop pairs assumed dependent after -fusion-max-dep-queries");
+STATISTIC(NumAddressesEliminated, "Number of redundant address computations removed from fused loops");
+STATISTIC(NumLoadsEliminated, "Number of redundant loads removed from fused loops");
+STATISTIC(NumArraysContracted, "Number of local arrays contracted into registers after fusion");
+
 namespace {
 
 /* -debug flag handler */
@@ -21,6 +64,118 @@ cl::opt<bool> AllowThrow(
 	cl::desc("Allow fusion for loops containing throw instructions"),
 	cl::init(true));
 
+/* Pairs scoring below this are not fused. A pair that shares no data scores 0 */
+cl::opt<int> FusionThreshold(
+	"fusion-threshold",
+	cl::desc("Minimal profitability score for fusing a pair of loops"),
+	cl::init(1));
+
+cl::opt<bool> PrintFusionCost(
+	"print-fusion-cost",
+	cl::desc("Print profitability score of every legal pair"),
+	cl::init(false));
+
+/* Trip count difference above this is not peeled */
+cl::opt<unsigned> MaxFusionPeel(
+	"max-fusion-peel",
+	cl::desc("Maximal number of iterations peeled to fuse loops with different trip counts"),
+	cl::init(8));
+
+/* False by default */
+cl::opt<bool> EnableFusionVersioning(
+	"fusion-versioning",
+	cl::desc("Fuse loops blocked by may-alias dependences or unequal symbolic trip counts behind runtime checks"),
+	cl::init(false));
+
+cl::opt<unsigned> MaxFusionRuntimeChecks(
+	"max-fusion-runtime-checks",
+	cl::desc("Maximal number of runtime checks emitted to version a pair of loops"),
+	cl::init(8));
+
+/* Dependence distance above this is not fixed by shifting */
+cl::opt<unsigned> MaxFusionShift(
+	"max-fusion-shift",
+	cl::desc("Maximal number of iterations the second loop may lag behind the first one in a fused loop"),
+	cl::init(4));
+
+enum VectorizationPolicy
+{
+	VP_Ignore,
+	VP_Preserve,
+	VP_Prefer,
+};
+
+cl::opt<VectorizationPolicy> FusionVectorization(
+	"fusion-vectorization",
+	cl::desc("How the forecast vectorizability of innermost loops affects fusion"),
+	cl::values(
+		clEnumValN(VP_Ignore, "ignore", "Do not forecast vectorizability"),
+		clEnumValN(VP_Preserve, "preserve", "Refuse fusions that turn a vectorizable loop into an unvectorizable one"),
+		clEnumValN(VP_Prefer, "prefer", "Also raise the score of pairs whose fused loop is forecast to vectorize")),
+	cl::init(VP_Preserve));
+
+/* True by default */
+cl::opt<bool> EnableFusedBodyCleanup(
+	"fusion-cleanup",
+	cl::desc("Remove address computations and loads the joined bodies of a fused loop repeat"),
+	cl::init(true));
+
+/* True by default */
+cl::opt<bool> EnableArrayContraction(
+	"fusion-contract-arrays",
+	cl::desc("Keep elements of local arrays that live through one iteration of a fused loop in registers"),
+	cl::init(true));
+
+/* Extension points of the default pipelines the pass inserts itself at */
+enum FusionExtensionPoint
+{
+	EP_VectorizerStart,
+	EP_ScalarOptimizerLate,
+	EP_LTO,
+};
+
+/* Empty by default, the pass runs only when spelled out in -passes */
+cl::bits<FusionExtensionPoint> FusionExtensionPoints(
+	"fusion-ep",
+	cl::desc("Insert fusion-pass into the default pipelines at these extension points"),
+	cl::values(
+		clEnumValN(EP_VectorizerStart, "vectorizer-start", "Right before the loop vectorizer"),
+		clEnumValN(EP_ScalarOptimizerLate, "scalar-late", "After the loop optimizations of the function simplification pipeline"),
+		clEnumValN(EP_LTO, "lto", "At the end of full LTO and of the ThinLTO backend")),
+	cl::CommaSeparated);
+
+cl::opt<unsigned> FusionMinOptLevel(
+	"fusion-min-opt-level",
+	cl::desc("Minimal speedup level (-O<n>) of a default pipeline fusion-pass is inserted into"),
+	cl::init(2));
+
+/* Budgets for huge functions, 0 means no limit */
+cl::opt<unsigned> MaxFusionSetSize(
+	"fusion-max-set-size",
+	cl::desc("Maximal number of loops in a control flow equivalent set, larger sets are split"),
+	cl::init(64));
+
+cl::opt<unsigned> MaxFusionDepQueries(
+	"fusion-max-dep-queries",
+	cl::desc("Maximal number of DependenceInfo queries for a pair of loops, the pair is assumed dependent beyond it"),
+	cl::init(4096));
+
+cl::opt<unsigned> MaxFusionsPerFunction(
+	"fusion-max-fusions",
+	cl::desc("Maximal number of loop pairs fused in one function"),
+	cl::init(1000));
+
+/* Times a phase under -time-passes and traces it under -ftime-trace */
+struct PhaseScope
+{
+	PhaseScope(StringRef Name, StringRef Description)
+		: Timer(Name, Description, DEBUG_TYPE, "Loop fusion phases", TimePassesIsEnabled), Trace(Description)
+	{}
+
+	NamedRegionTimer Timer;
+	TimeTraceScope Trace;
+};
+
 bool
 loopHasMultipleEntriesAndExits(const Loop &L)
 {
@@ -86,19 +241,33 @@ loopContainsVolatileInst(const Loop &L)
 	return false;
 } /* loopContainsVolatileInst */
 
+/* A guarded rotated loop is entered at its guard, the preheader only runs when the guard is taken */
+const BasicBlock *
+getLoopEntry(const Loop *L)
+{
+	if (L->isRotatedForm())
+	{
+		if (const BranchInst *Guard = L->getLoopGuardBranch())
+		{
+			return Guard->getParent();
+		}
+	}
+	return L->getLoopPreheader();
+} /* getLoopEntry */
+
 bool
 loopDominates(const Loop *L1, const Loop *L2, const DominatorTree &DT)
 {
-	const BasicBlock *H1 = L1->getLoopPreheader();
-	const BasicBlock *H2 = L2->getLoopPreheader();
+	const BasicBlock *H1 = getLoopEntry(L1);
+	const BasicBlock *H2 = getLoopEntry(L2);
 	return DT.properlyDominates(H1, H2);
 } /* loopDominates */
 
 bool
 loopPostDominates(const Loop *L1, const Loop *L2, const PostDominatorTree &PDT)
 {
-	const BasicBlock *H1 = L1->getLoopPreheader();
-	const BasicBlock *H2 = L2->getLoopPreheader();
+	const BasicBlock *H1 = getLoopEntry(L1);
+	const BasicBlock *H2 = getLoopEntry(L2);
 	return PDT.properlyDominates(H1, H2);
 } /* loopPostDominates */
 
@@ -108,76 +277,129 @@ isControlFlowEqLoops(const Loop *L1, const Loop *L2, const DominatorTree &DT, co
 	return (loopDominates(L1, L2, DT) && loopPostDominates(L2, L1, PDT));
 } /* isControlFlowEqLoops */
 
+/* Walks the use list of OldValue, so the cost depends on the number of uses, not on the size of L */
 void
-replaceVariableInBlock(BasicBlock &BB, Value *OldValue, Value *NewValue)
+replaceVariableInLoop(const Loop &L, Value *OldValue, Value *NewValue)
 {
-	for (Instruction &I : BB)
+	OldValue->replaceUsesWithIf(
+		NewValue,
+		[&L](Use &U)
+		{
+			const Instruction *User = dyn_cast<Instruction>(U.getUser());
+			return User && L.contains(User);
+		}
+	);
+} /* replaceVariableInLoop */
+
+const ICmpInst *
+getExitCompare(const BasicBlock &BB)
+{
+	const BranchInst *BI = dyn_cast<BranchInst>(BB.getTerminator());
+	if (!BI || BI->isUnconditional())
+	{
+		return nullptr;
+	}
+	return dyn_cast<ICmpInst>(BI->getCondition());
+} /* getExitCompare */
+
+/* Rotated loops exit from the latch and compare the next value of the index, others compare the index in the header */
+PHINode *
+getIndex(const BasicBlock &Header)
+{
+	for (const PHINode &Phi : Header.phis())
 	{
-		for (Use &U : I.operands())
+		for (unsigned i = 0, e = Phi.getNumIncomingValues(); i < e; i++)
 		{
-			if (U.get() == OldValue) 
+			const ICmpInst *Cmp = getExitCompare(*Phi.getIncomingBlock(i));
+			if (Cmp && Cmp->getOperand(0) == Phi.getIncomingValue(i))
 			{
-				U.set(NewValue);
+				return const_cast<PHINode *>(&Phi);
 			}
 		}
 	}
-} /* replaceVariableInBlock */
 
-void
-replaceVariableInLoop(Loop &L, Value *OldValue, Value *NewValue)
+	const ICmpInst *Cmp = getExitCompare(Header);
+	if (!Cmp)
+	{
+		return nullptr;
+	}
+	PHINode *Index = dyn_cast<PHINode>(Cmp->getOperand(0));
+	return (Index && Index->getParent() == &Header) ? Index : nullptr;
+} /* getIndex */
+
+bool
+isIndex(const PHINode &Phi)
 {
-	for (BasicBlock *BB : L.blocks())
+	return getIndex(*Phi.getParent()) == &Phi;
+} /* isIndex */
+
+/* Successor of the header that stays in the loop */
+BasicBlock *
+getBodyEntry(const Loop &L)
+{
+	for (BasicBlock *Succ : successors(L.getHeader()))
 	{
-		replaceVariableInBlock(*BB, OldValue, NewValue);
+		if (L.contains(Succ))
+		{
+			return Succ;
+		}
 	}
-} /* replaceVariableInLoop */
+	return nullptr;
+} /* getBodyEntry */
 
 void
-replaceVariableInFunction(Function &F, Value *OldValue, Value *NewValue)
+replaceSuccessor(BasicBlock *BB, BasicBlock *OldSucc, BasicBlock *NewSucc, SmallVectorImpl<DominatorTree::UpdateType> &TreeUpdates)
 {
-	for (BasicBlock &BB : F)
+	BB->getTerminator()->replaceSuccessorWith(OldSucc, NewSucc);
+	TreeUpdates.push_back({DominatorTree::Delete, BB, OldSucc});
+	TreeUpdates.push_back({DominatorTree::Insert, BB, NewSucc});
+} /* replaceSuccessor */
+
+void
+redirectPredecessors(BasicBlock *From, BasicBlock *To, SmallVectorImpl<DominatorTree::UpdateType> &TreeUpdates)
+{
+	while (pred_begin(From) != pred_end(From))
 	{
-		replaceVariableInBlock(BB, OldValue, NewValue);
+		replaceSuccessor(*pred_begin(From), From, To, TreeUpdates);
 	}
-} /* replaceVariableInFunction */
+} /* redirectPredecessors */
 
-bool
-isIndex(const BasicBlock &BB, const Value &V)
+void
+recordSuccessorsRemoval(BasicBlock *BB, SmallVectorImpl<DominatorTree::UpdateType> &TreeUpdates)
 {
-	for (auto it1 = BB.begin(), it2 = std::next(it1); it2 != BB.end(); ++it1, ++it2)
+	for (BasicBlock *Succ : successors(BB))
 	{
-		if (&*it2 == BB.getTerminator())
-		{
-			if (it1->getOpcode() == Instruction::ICmp && it1->getOperand(0) == &V)
-			{
-				if (it2->getOperand(0) == &*it1)
-				{
-					return true;
-				}
-			}
-		}
+		TreeUpdates.push_back({DominatorTree::Delete, BB, Succ});
 	}
-	return false;
-} /* isIndex */
+} /* recordSuccessorsRemoval */
 
-Value *
-getIndex(const BasicBlock &Header)
+/* Move remaining blocks and subloops of L2 into L1 and drop L2 from LoopInfo */
+void
+mergeLoopInfo(Loop *L1, Loop *L2, LoopInfo &LI)
 {
-	for (auto it1 = Header.begin(), it2 = std::next(it1); it2 != Header.end(); ++it1, ++it2)
+	SmallVector<BasicBlock *, 8> Blocks(L2->blocks());
+	for (BasicBlock *BB : Blocks)
 	{
-		if (&*it2 == Header.getTerminator())
+		L1->addBlockEntry(BB);
+		L2->removeBlockFromLoop(BB);
+		if (LI.getLoopFor(BB) == L2)
 		{
-			if (it1->getOpcode() == Instruction::ICmp &&  it2->getOperand(0) == &*it1)
-			{
-				return it1->getOperand(0);
-			}
+			LI.changeLoopFor(BB, L1);
 		}
 	}
-	return nullptr;
-} /* getIndex */
+	while (!L2->isInnermost())
+	{
+		auto ChildIt = L2->begin();
+		Loop *Child = *ChildIt;
+		L2->removeChildLoop(ChildIt);
+		L1->addChildLoop(Child);
+	}
+	LI.erase(L2);
+} /* mergeLoopInfo */
 
+/* Header-exiting loops: Latch1 moves after Latch2, the body of L2 runs between the body and the latch of L1 */
 void
-fuse(Loop *L1, Loop *L2)
+fuseUnrotated(Loop *L1, Loop *L2, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE, bool Shifted)
 {
 	BasicBlock *Header1 = L1->getHeader(); /* Will be Header */
 	BasicBlock *Header2 = L2->getHeader(); /* Will be deleted */
@@ -188,36 +410,38 @@ fuse(Loop *L1, Loop *L2)
 
 	assert(Latch1->size() == Latch2->size());
 
-	BasicBlock *BodyEntry2 = Header2->getTerminator()->getSuccessor(0);
-	BasicBlock *Exit2 = Header2->getTerminator()->getSuccessor(1);
+	BasicBlock *BodyEntry2 = getBodyEntry(*L2);
+	BasicBlock *Exit2 = L2->getExitBlock();
 
 	assert(PreHeader2->size() == 1 && "Incorrect PreHeader2 size");
 
+	/* Both loops change shape, so drop what SE knows about them */
+	SE.forgetLoop(L2);
+	SE.forgetLoop(L1);
+	SE.forgetBlockAndLoopDispositions();
+
+	SmallVector<DominatorTree::UpdateType, 16> TreeUpdates;
+
 	/* Unlink Latch1 from first loop and move it after Latch2 */
-	while (pred_begin(Latch1) != pred_end(Latch1))
-	{
-		(*(pred_begin(Latch1)))->getTerminator()->replaceSuccessorWith(Latch1, BodyEntry2);
-	}
+	redirectPredecessors(Latch1, BodyEntry2, TreeUpdates);
 
 	Latch1->moveAfter(Latch2);
-	Instruction *Latch2Term = Latch2->getTerminator();
-	Latch2Term->replaceSuccessorWith(Header2, Latch1);
+	replaceSuccessor(Latch2, Header2, Latch1, TreeUpdates);
 
 	/* Since PreHeader2 consists only of one branch instruction, no need to preserve it */
-	Instruction *Header1Term = Header1->getTerminator();
-	Header1Term->replaceSuccessorWith(PreHeader2, Exit2);
+	replaceSuccessor(Header1, PreHeader2, Exit2, TreeUpdates);
+	Exit2->replacePhiUsesWith(Header2, Header1);
 
 	/* Update phis' values */
-	Function *F = Header1->getParent();
 	SmallVector<PHINode *> PhiToDelete;
 	for (PHINode &Phi2 : Header2->phis())
 	{
 		Value *OldValue = &Phi2;
-		if (isIndex(*Header2, Phi2))
+		if (isIndex(Phi2) && !Shifted)
 		{
 			Value *NewValue = getIndex(*Header1);
 
-			replaceVariableInFunction(*F, OldValue, NewValue);
+			OldValue->replaceAllUsesWith(NewValue);
 			PhiToDelete.push_back(&Phi2);
 		}
 		else
@@ -233,7 +457,7 @@ fuse(Loop *L1, Loop *L2)
 					replaceVariableInLoop(*L2, OldValue, NewValue);
 
 					/* Update global scope */
-					replaceVariableInFunction(*F, OldValue, &Phi1);
+					OldValue->replaceAllUsesWith(&Phi1);
 					PhiToDelete.push_back(&Phi2);
 				}
 			}
@@ -257,16 +481,181 @@ fuse(Loop *L1, Loop *L2)
 	}
 
 	assert(Header2->size() == 2 && "Incorrect Header2 size");
-	
-	while (pred_begin(Latch2) != pred_end(Latch2))
+
+	/* The kept index of L2 is still incremented in Latch2 */
+	if (Shifted)
 	{
-		(*(pred_begin(Latch2)))->getTerminator()->replaceSuccessorWith(Latch2, Latch1);
+		while (&Latch2->front() != Latch2->getTerminator())
+		{
+			Latch2->front().moveBefore(Latch1->getTerminator());
+		}
 	}
 	
+	redirectPredecessors(Latch2, Latch1, TreeUpdates);
+	
+	/* Cleanup */
+	recordSuccessorsRemoval(PreHeader2, TreeUpdates);
+	recordSuccessorsRemoval(Header2, TreeUpdates);
+	recordSuccessorsRemoval(Latch2, TreeUpdates);
+
+	LI.removeBlock(PreHeader2);
+	LI.removeBlock(Header2);
+	LI.removeBlock(Latch2);
+	mergeLoopInfo(L1, L2, LI);
+
+	DTU.applyUpdates(TreeUpdates);
+	DTU.deleteBB(PreHeader2);
+	DTU.deleteBB(Latch2);
+	DTU.deleteBB(Header2);
+	DTU.flush();
+} /* fuseUnrotated */
+
+/* Chaining Phi2 through Phi1 interleaves the updates of both loops. That keeps the result only if both are reductions
+   of the same reassociable kind and nothing but Phi2 sees the value L1 leaves */
+bool
+canChainRecurrences(PHINode &Phi1, Loop *L1, PHINode &Phi2, Loop *L2)
+{
+	/* The value L1 leaves is the latch update of a rotated loop and the header phi of a header-exiting one */
+	Value *Final1 = L1->isRotatedForm() ? Phi1.getIncomingValueForBlock(L1->getLoopLatch()) : &Phi1;
+	for (const User *U : Final1->users())
+	{
+		if (U == &Phi1 || U == &Phi2 || (!L1->isRotatedForm() && L1->contains(cast<Instruction>(U))))
+		{
+			continue;
+		}
+		return false;
+	}
+
+	/* Without ScalarEvolution the descriptors reject reductions whose intermediate values are stored */
+	RecurrenceDescriptor RD1;
+	RecurrenceDescriptor RD2;
+	if (!RecurrenceDescriptor::isReductionPHI(&Phi1, L1, RD1) || !RecurrenceDescriptor::isReductionPHI(&Phi2, L2, RD2))
+	{
+		return false;
+	}
+	if (RD1.getRecurrenceKind() != RD2.getRecurrenceKind() || RD1.getExactFPMathInst() || RD2.getExactFPMathInst())
+	{
+		return false;
+	}
+	switch (RD1.getRecurrenceKind())
+	{
+		case RecurKind::Add:
+		case RecurKind::Mul:
+		case RecurKind::Or:
+		case RecurKind::And:
+		case RecurKind::Xor:
+		case RecurKind::SMin:
+		case RecurKind::SMax:
+		case RecurKind::UMin:
+		case RecurKind::UMax:
+		case RecurKind::FAdd:
+		case RecurKind::FMul:
+		case RecurKind::FMin:
+		case RecurKind::FMax:
+			return true;
+		default:
+			return false;
+	}
+} /* canChainRecurrences */
+
+/* Rotated loops: Latch1 falls through into Header2 and Latch2 becomes the latch. The exit test of L1 is dropped */
+void
+fuseRotated(Loop *L1, Loop *L2, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE)
+{
+	BasicBlock *Header1 = L1->getHeader(); /* Will be Header */
+	BasicBlock *Header2 = L2->getHeader(); /* Joins the body */
+	BasicBlock *Latch1 = L1->getLoopLatch(); /* Joins the body */
+	BasicBlock *Latch2 = L2->getLoopLatch(); /* Will be Latch */
+	BasicBlock *PreHeader1 = L1->getLoopPreheader();
+	BasicBlock *PreHeader2 = L2->getLoopPreheader(); /* Will be deleted */
+
+	assert(L1->getExitBlock() == PreHeader2 && PreHeader2->size() == 1 && "Loops are not adjacent");
+
+	SE.forgetLoop(L2);
+	SE.forgetLoop(L1);
+	SE.forgetBlockAndLoopDispositions();
+
+	SmallVector<DominatorTree::UpdateType, 16> TreeUpdates;
+
+	/* Update phis' values. Values L2 continues from L1 are chained through Phi1 */
+	PHINode *Index1 = getIndex(*Header1);
+	SmallVector<PHINode *> PhiToDelete;
+	for (PHINode &Phi2 : Header2->phis())
+	{
+		Value *Start = Phi2.getIncomingValueForBlock(PreHeader2);
+		if (isIndex(Phi2))
+		{
+			Phi2.replaceAllUsesWith(Index1);
+			PhiToDelete.push_back(&Phi2);
+			continue;
+		}
+		for (PHINode &Phi1 : Header1->phis())
+		{
+			if (Phi1.getIncomingValueForBlock(Latch1) == Start && canChainRecurrences(Phi1, L1, Phi2, L2))
+			{
+				Phi1.setIncomingValueForBlock(Latch1, Phi2.getIncomingValueForBlock(Latch2));
+				Phi2.replaceAllUsesWith(Start);
+				PhiToDelete.push_back(&Phi2);
+				break;
+			}
+		}
+	}
+	for (PHINode *Phi : PhiToDelete)
+	{
+		Phi->eraseFromParent();
+	}
+
+	Header1->replacePhiUsesWith(Latch1, Latch2);
+	Header2->replacePhiUsesWith(PreHeader2, PreHeader1);
+
+	/* Move phis to Header1 */
+	Instruction *FirstNonPhi1 = Header1->getFirstNonPHI();
+	while (Header2->begin()->getOpcode() == Instruction::PHI)
+	{
+		Instruction *Phi = &*(Header2->begin());
+		Phi->moveBefore(FirstNonPhi1);
+	}
+
+	/* Both loops run the same number of iterations, Latch2 alone decides when to exit */
+	BranchInst *LatchBranch1 = cast<BranchInst>(Latch1->getTerminator());
+	Instruction *ExitCond1 = dyn_cast<Instruction>(LatchBranch1->getCondition());
+	recordSuccessorsRemoval(Latch1, TreeUpdates);
+	LatchBranch1->eraseFromParent();
+	BranchInst::Create(Header2, Latch1);
+	TreeUpdates.push_back({DominatorTree::Insert, Latch1, Header2});
+	if (ExitCond1 && ExitCond1->use_empty())
+	{
+		ExitCond1->eraseFromParent();
+	}
+
+	replaceSuccessor(Latch2, Header2, Header1, TreeUpdates);
+
 	/* Cleanup */
-	PreHeader2->eraseFromParent();
-	Header2->eraseFromParent();
-	Latch2->eraseFromParent();
+	recordSuccessorsRemoval(PreHeader2, TreeUpdates);
+
+	LI.removeBlock(PreHeader2);
+	mergeLoopInfo(L1, L2, LI);
+
+	DTU.applyUpdates(TreeUpdates);
+	DTU.deleteBB(PreHeader2);
+	DTU.flush();
+
+	/* Values of the old L1 used after the loop now need exit phis in the exit of L2 */
+	formLCSSA(*L1, DTU.getDomTree(), &LI, &SE);
+} /* fuseRotated */
+
+/* A shifted L2 runs behind L1 and keeps its own index */
+void
+fuse(Loop *L1, Loop *L2, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE, bool Shifted = false)
+{
+	if (L1->isRotatedForm())
+	{
+		fuseRotated(L1, L2, LI, DTU, SE);
+	}
+	else
+	{
+		fuseUnrotated(L1, L2, LI, DTU, SE, Shifted);
+	}
 } /* fuse */
 
 SmallVector<Loop *>
@@ -296,51 +685,38 @@ collectLoopsAtDepth(const LoopInfo &LI, unsigned Depth)
 	return LoopsAtDepth;
 } /* collectLoopsAtDepth */
 
-bool
-tryInsertInCFESet(std::list<Loop *> &set, Loop *L, const DominatorTree &DT, const PostDominatorTree &PDT)
-{
-	if (set.empty())
-	{
-		return false;
-	}
-
-	for (auto it = set.begin(); it != set.end(); ++it)
-	{
-		if (it == set.begin() && isControlFlowEqLoops(L, *it, DT, PDT))
-		{
-			set.insert(it, L);
-			return true;
-		}
+/* Control flow equivalent loops in program order */
+using CFESet = SmallVector<Loop *, 4>;
 
-		auto nit = std::next(it);
-		if (nit != set.end() 
-			&& isControlFlowEqLoops(*it, L, DT, PDT) && isControlFlowEqLoops(L, *nit, DT, PDT))
+/* Loops are visited in dominator tree preorder of their entries. Sets whose last loop no longer
+   dominates the visited one can't grow anymore, so only a stack of open sets is checked */
+SmallVector<CFESet>
+buildCFESets(SmallVector<Loop *> &Candidates, DominatorTree &DT, const PostDominatorTree &PDT)
+{
+	DT.updateDFSNumbers();
+	llvm::sort(
+		Candidates,
+		[&DT](const Loop *L1, const Loop *L2)
 		{
-			set.insert(nit, L);
-			return true;
+			return DT.getNode(getLoopEntry(L1))->getDFSNumIn() < DT.getNode(getLoopEntry(L2))->getDFSNumIn();
 		}
+	);
 
-		if (nit == set.end() && isControlFlowEqLoops(*it, L, DT, PDT))
+	SmallVector<CFESet> CFEs;
+	SmallVector<unsigned, 8> OpenSets;
+	for (Loop *L : Candidates)
+	{
+		while (!OpenSets.empty() && loopDominates(CFEs[OpenSets.back()].back(), L, DT) == false)
 		{
-			set.push_back(L);
-			return true;
+			OpenSets.pop_back();
 		}
-	}
-	return false;
-} /* tryInsertInCFESet */
 
-std::list<std::list<Loop *>>
-buildCFESets(const std::set<Loop *> &Candidates, const DominatorTree &DT, const PostDominatorTree &PDT)
-{
-	std::list<std::list<Loop *>> CFEs;
-
-	for (Loop *L : Candidates)
-	{
 		bool inserted = false;
-		for (auto &set : CFEs)
+		for (unsigned Idx : reverse(OpenSets))
 		{
-			if (tryInsertInCFESet(set, L, DT, PDT))
+			if (isControlFlowEqLoops(CFEs[Idx].back(), L, DT, PDT))
 			{
+				CFEs[Idx].push_back(L);
 				inserted = true;
 				break;
 			}
@@ -348,26 +724,57 @@ buildCFESets(const std::set<Loop *> &Candidates, const DominatorTree &DT, const
 
 		if (inserted == false)
 		{
-			CFEs.push_back(std::list<Loop *> {L});
+			CFEs.push_back(CFESet {L});
+			OpenSets.push_back(CFEs.size() - 1);
 		}
 	}
 
 	/* Delete sets with only one loop */
-	CFEs.erase(
-		std::remove_if(
-			CFEs.begin(),
-			CFEs.end(),
-			[](const std::list<Loop *> &set)
-			{
-				return set.size() == 1;
-			}
-		),
-		CFEs.end()
+	erase_if(
+		CFEs,
+		[](const CFESet &set)
+		{
+			return set.size() == 1;
+		}
 	);
 
 	return CFEs;
 } /* buildCFESets */
 
+/* Every pair of a set may be tried, so huge sets are cut into chunks of MaxFusionSetSize loops fused separately */
+SmallVector<CFESet>
+splitOversizedSets(SmallVector<CFESet> CFEs, OptimizationRemarkEmitter &ORE)
+{
+	if (MaxFusionSetSize == 0)
+	{
+		return CFEs;
+	}
+
+	SmallVector<CFESet> Split;
+	for (const CFESet &set : CFEs)
+	{
+		if (set.size() > MaxFusionSetSize)
+		{
+			const Loop *First = set[MaxFusionSetSize];
+			ORE.emit([&]()
+			{
+				return OptimizationRemarkAnalysis(DEBUG_TYPE, "SetSizeBudget", First->getStartLoc(), First->getHeader())
+					<< "set of " << ore::NV("Loops", unsigned(set.size())) << " control flow equivalent loops split into chunks of "
+					<< ore::NV("MaxSetSize", unsigned(MaxFusionSetSize));
+			});
+		}
+		for (size_t Begin = 0; Begin < set.size(); Begin += MaxFusionSetSize)
+		{
+			size_t End = std::min<size_t>(Begin + MaxFusionSetSize, set.size());
+			if (End - Begin > 1)
+			{
+				Split.push_back(CFESet(set.begin() + Begin, set.begin() + End));
+			}
+		}
+	}
+	return Split;
+} /* splitOversizedSets */
+
 bool
 blockProducesValue(BasicBlock *BB, const Value *V)
 {
@@ -421,116 +828,91 @@ blocksHaveNegativeDependencies(const BasicBlock &First, const BasicBlock &Second
 	return false;
 }*/
 
-bool
-refersToIndex(const Instruction &I)
-{
-	assert(I.getOpcode() == Instruction::GetElementPtr);
-	bool AllIndex = true;
+/* Memory accesses grouped by underlying object. Calls and accesses without a known object go under nullptr */
+using AccessSummary = MapVector<const Value *, SmallVector<Instruction *, 4>>;
 
-	for (Value *V : I.operands())
+void
+summarizeBlock(BasicBlock &BB, AccessSummary &Summary)
+{
+	for (Instruction &I : BB)
 	{
-		if (isa<Constant>(V) || isa<Argument>(V))
+		if (!I.mayReadOrWriteMemory())
 		{
-			//errs() << I.getNumOperands() <<" const\n";
 			continue;
 		}
 
-		Instruction *II = dyn_cast<Instruction>(V);
-		if (!II)
-		{
-			return false;
-		}
-		else if (II->getOpcode() == Instruction::SExt || II->getOpcode() == Instruction::ZExt)
-		{
-			II = dyn_cast<Instruction>(II->getOperand(0));
-			if (II && II->getOpcode() == Instruction::PHI)
-			{
-				AllIndex &= isIndex(*(II->getParent()), *II);
-			}
-			else
-			{
-				//errs() << "f1\n";
-				return false;
-			}
-		}
-		else if (II->getOpcode() == Instruction::GetElementPtr)
-		{
-			AllIndex &= refersToIndex(*II);
-		}
-		else if (II->getOpcode() == Instruction::PHI)
+		const Value *Object = nullptr;
+		if (const Value *Ptr = getLoadStorePointerOperand(&I))
 		{
-			AllIndex &= isIndex(*(II->getParent()), *II);
-		}
-		else
-		{	
-			//errs() << II->getOpcodeName() <<" f2\n";
-			return false;
+			Object = getUnderlyingObject(Ptr);
 		}
+		Summary[Object].push_back(&I);
 	}
-	return AllIndex;
-} /* refersToIndex */
+} /* summarizeBlock */
 
-bool
-areSameIndex(const Instruction &I1, const Instruction &I2)
+AccessSummary
+summarizeLoop(const Loop &L)
 {
-	assert(I1.getOpcode() == Instruction::GetElementPtr && I2.getOpcode() == Instruction::GetElementPtr);
-
-	/* For both GEP instructions check if they refer to unmodified loop index */
-	return refersToIndex(I1) && refersToIndex(I2);
-} /* areSameIndex */
+	AccessSummary Summary;
+	for (BasicBlock *BB : L.blocks())
+	{
+		summarizeBlock(*BB, Summary);
+	}
+	return Summary;
+} /* summarizeLoop */
 
 bool
-blocksHaveFlowDependencies(BasicBlock &BB1, BasicBlock &BB2, DependenceInfo &DI)
+objectsMayAlias(const Value *Object1, const Value *Object2, AAResults &AA)
 {
-	for (Instruction &I1 : BB1)
+	if (!Object1 || !Object2)
 	{
-		for (Instruction &I2 : BB2)
-		{
-			if (const auto Dep = DI.depends(&I1, &I2, true))
-			{
-				if (Dep->isFlow())
-				{
-					return true;
-				}
-			}
-		}
+		return true;
 	}
-	return false;
-} /* blocksHaveFlowDependencies */
+	return !AA.isNoAlias(MemoryLocation::getBeforeOrAfter(Object1), MemoryLocation::getBeforeOrAfter(Object2));
+} /* objectsMayAlias */
 
+/* Query DI only for read/write pairs of possibly aliasing objects. Stops once IsInvalid returns true. Queries counts
+   the queries of the whole candidate pair, beyond MaxFusionDepQueries the summaries are assumed dependent and
+   OutOfBudget is set */
 bool
-loopsHaveInvalidDependencies(const Loop *L1, const Loop *L2, DependenceInfo &DI)
+summariesHaveDependence(const AccessSummary &Summary1, const AccessSummary &Summary2, AAResults &AA, DependenceInfo &DI,
+	unsigned &Queries, function_ref<bool(const Dependence &)> IsInvalid, bool *OutOfBudget = nullptr)
 {
-	/* For now only simple flow is allowed (array access at unmodified loop index) */
-	for (BasicBlock *BB1 : L1->blocks())
+	for (const auto &[Object1, Accesses1] : Summary1)
 	{
-		for (Instruction &I1 : *BB1)
+		for (const auto &[Object2, Accesses2] : Summary2)
 		{
-			for (BasicBlock *BB2 : L2->blocks())
+			if (!objectsMayAlias(Object1, Object2, AA))
+			{
+				NumDepQueriesPruned += Accesses1.size() * Accesses2.size();
+				continue;
+			}
+
+			for (Instruction *I1 : Accesses1)
 			{
-				for (Instruction &I2 : *BB2)
+				for (Instruction *I2 : Accesses2)
 				{
-					if (const auto Dep = DI.depends(&I1, &I2, true))
+					if (!I1->mayWriteToMemory() && !I2->mayWriteToMemory())
+					{
+						NumDepQueriesPruned++;
+						continue;
+					}
+
+					if (MaxFusionDepQueries && ++Queries > MaxFusionDepQueries)
+					{
+						NumDepBudgetsExceeded++;
+						if (OutOfBudget)
+						{
+							*OutOfBudget = true;
+						}
+						return true;
+					}
+
+					NumDepQueries++;
+					if (const auto Dep = DI.depends(I1, I2, true))
 					{
-						if (Dep->isFlow())
+						if (IsInvalid(*Dep))
 						{
-							//errs() << "Entereddep\n";
-							//errs() << Dep->getSrc()->getOpcodeName() << " ";
-							//errs() << Dep->getDst()->getOpcodeName() << "\n";
-							Instruction *Src, *Dst;
-							if ((Src = dyn_cast<Instruction>(Dep->getSrc()->getOperand(1))) && (Dst = dyn_cast<Instruction>(Dep->getDst()->getOperand(0))))
-							{
-								if (Src->getOpcode() == Instruction::GetElementPtr && Dst->getOpcode() == Instruction::GetElementPtr)
-								{
-									//errs() << "test same index: ";
-									if (areSameIndex(*Src, *Dst))
-									{
-										//errs() << "a[i]\n";
-										continue;
-									}
-								}
-							}
-							//errs() << "inv dep\n";
 							return true;
 						}
 					}
@@ -539,317 +921,2823 @@ loopsHaveInvalidDependencies(const Loop *L1, const Loop *L2, DependenceInfo &DI)
 		}
 	}
 	return false;
-} /* loopsHaveInvalidDependencies */
+} /* summariesHaveDependence */
+
+/* Why L can not be fused with any loop, empty if it can */
+StringRef
+getCandidateBlocker(const Loop &L)
+{
+	if (!L.isLoopSimplifyForm()) return "it is not in loop simplify form";
+	if (loopContainsVolatileInst(L)) return "it contains volatile accesses";
+	if (loopMightThrowException(L) && !AllowThrow) return "it might throw"; /* Somehow always false */
+	if (loopHasMultipleEntriesAndExits(L)) return "it has multiple entries or exits";
+	return "";
+} /* getCandidateBlocker */
 
 bool
-areLoopsAdjacent(const Loop *L1, const Loop *L2)
+isFusionCandidate(const Loop &L)
 {
-	BasicBlock *Exit1 = L1->getExitBlock();
-	assert(Exit1 && "Loop 1 has no exit block");
-	if (Exit1 != L2->getLoopPreheader())
+	return getCandidateBlocker(L).empty();
+} /* isFusionCandidate */
+
+using RegisterPressure = SmallDenseMap<unsigned, unsigned, 4>;
+
+/* Values live through every iteration, per register class: header phis and loop live-ins */
+RegisterPressure
+estimateRegisterPressure(const Loop &L, const TargetTransformInfo &TTI)
+{
+	RegisterPressure Pressure;
+	for (const PHINode &Phi : L.getHeader()->phis())
+	{
+		Pressure[TTI.getRegisterClassForType(Phi.getType()->isVectorTy(), Phi.getType())]++;
+	}
+
+	SmallPtrSet<const Value *, 16> LiveIns;
+	for (const BasicBlock *BB : L.blocks())
+	{
+		for (const Instruction &I : *BB)
+		{
+			for (const Value *V : I.operands())
+			{
+				const Instruction *Def = dyn_cast<Instruction>(V);
+				if ((isa<Argument>(V) || (Def && !L.contains(Def))) && LiveIns.insert(V).second)
+				{
+					Pressure[TTI.getRegisterClassForType(V->getType()->isVectorTy(), V->getType())]++;
+				}
+			}
+		}
+	}
+	return Pressure;
+} /* estimateRegisterPressure */
+
+/* Why a pair of loops is not fused */
+enum FusionBlocker
+{
+	FB_None,
+	FB_MixedRotation,
+	FB_UnknownTripCount,
+	FB_DifferentIndex,
+	FB_TripCountMismatch,
+	FB_Dependence,
+	FB_LosesVectorization,
+	FB_Unprofitable,
+	FB_GuardsDiffer,
+	FB_InterferingCode,
+	FB_CodeBetweenLoops,
+	FB_NotAdjacent,
+	FB_RotatedShape,
+	FB_VersioningFailed,
+	FB_PeelingFailed,
+	FB_Recurrence,
+};
+
+/* Remark names are stable keys for aggregating -pass-remarks-output */
+const struct
+{
+	const char *Name;
+	const char *Message;
+} BlockerDescriptions[] =
+{
+	{"Fusible", "none"},
+	{"MixedRotation", "only one of the loops is rotated"},
+	{"UnknownTripCount", "trip count is not computable"},
+	{"DifferentIndex", "indices have different steps or starts a prologue can not align"},
+	{"TripCountMismatch", "trip counts differ by more than can be peeled"},
+	{"Dependence", "a dependence between the loops would turn backward"},
+	{"LosesVectorization", "the fused loop would not vectorize"},
+	{"Unprofitable", "profitability score is below -fusion-threshold"},
+	{"GuardsDiffer", "loop guards test different conditions"},
+	{"InterferingCode", "code between the loops can not be moved out of the way"},
+	{"CodeBetweenLoops", "instructions between the loops can not be hoisted or sunk"},
+	{"NotAdjacent", "loops are not adjacent"},
+	{"RotatedShape", "rotated loops have a shape fusion can not join"},
+	{"VersioningFailed", "runtime checks can not be emitted"},
+	{"PeelingFailed", "remaining iterations can not be peeled"},
+	{"Recurrence", "a value L2 continues from L1 is not a reduction of the same kind"},
+};
+
+/* Facts about a loop that do not depend on the loop it is paired with */
+struct LoopFacts
+{
+	const SCEV *TripCount;
+	bool IsCandidate;
+	AccessSummary Accesses;
+	RegisterPressure Pressure;
+};
+
+/* Per-function cache of loop facts and pairwise verdicts. Only entries of loops touched by a fusion are dropped */
+class FusionCache
+{
+public:
+	FusionCache(ScalarEvolution &SE, const TargetTransformInfo &TTI, LoopAccessInfoManager &LAIs) : SE(SE), TTI(TTI), LAIs(LAIs) {}
+
+	const LoopFacts &
+	getFacts(const Loop *L)
+	{
+		std::unique_ptr<LoopFacts> &Facts = LoopFactsMap[L];
+		if (!Facts)
+		{
+			PhaseScope Phase("facts", "Loop facts");
+			Facts = std::make_unique<LoopFacts>(LoopFacts
+				{
+					SE.getSymbolicMaxBackedgeTakenCount(L),
+					isFusionCandidate(*L),
+					summarizeLoop(*L),
+					estimateRegisterPressure(*L, TTI)
+				}
+			);
+		}
+		return *Facts;
+	}
+
+	std::optional<FusionBlocker>
+	getPairVerdict(const Loop *L1, const Loop *L2) const
+	{
+		auto it = PairVerdicts.find({L1, L2});
+		if (it == PairVerdicts.end())
+		{
+			return std::nullopt;
+		}
+		return it->second;
+	}
+
+	void
+	setPairVerdict(const Loop *L1, const Loop *L2, FusionBlocker Blocker)
+	{
+		PairVerdicts[{L1, L2}] = Blocker;
+	}
+
+	/* Statistics count every loop, set and pair once however often the worklist revisits it. A set is keyed by its
+	   first loop as L2 */
+	bool
+	markCounted(const Loop *L1, const Loop *L2)
+	{
+		return Counted.insert({L1, L2}).second;
+	}
+
+	/* A refused pair counts as refused only if no later visit fuses it */
+	void
+	markRefused(const Loop *L1, const Loop *L2, bool Refused)
+	{
+		if (Refused)
+		{
+			RefusedPairs.insert({L1, L2});
+		}
+		else
+		{
+			RefusedPairs.erase({L1, L2});
+		}
+	}
+
+	unsigned
+	getNumRefused() const
+	{
+		return RefusedPairs.size();
+	}
+
+	/* False if the pair was already reported since either loop last changed. L2 is nullptr for a single loop */
+	bool
+	markReported(const Loop *L1, const Loop *L2)
+	{
+		return Reported.insert({L1, L2}).second;
+	}
+
+	void
+	invalidateFused(const Loop *L1, const Loop *L2)
+	{
+		for (const Loop *L = L1; L; L = L->getParentLoop())
+		{
+			invalidate(L);
+		}
+		invalidate(L2);
+		invalidateMemorySSA();
+		LAIs.clear();
+	}
+
+	/* Instructions of L or of its inner loops were rewritten */
+	void
+	invalidateNest(const Loop *L)
+	{
+		for (const Loop *Parent = L->getParentLoop(); Parent; Parent = Parent->getParentLoop())
+		{
+			invalidate(Parent);
+		}
+		for (const Loop *Inner : L->getLoopsInPreorder())
+		{
+			invalidate(Inner);
+		}
+		invalidateMemorySSA();
+		LAIs.clear();
+	}
+
+	/* The manager caches per Loop pointer, so it is cleared together with the facts of fused loops */
+	const LoopAccessInfo &
+	getAccessInfo(Loop *L)
+	{
+		PhaseScope Phase("loop-access", "LoopAccessInfo rebuild");
+		return LAIs.getInfo(*L);
+	}
+
+	/* Fusions performed in the function, limited by -fusion-max-fusions */
+	unsigned
+	countFusion()
+	{
+		return ++NumFused;
+	}
+
+	bool
+	isFusionBudgetExhausted() const
+	{
+		return MaxFusionsPerFunction && NumFused >= MaxFusionsPerFunction;
+	}
+
+	/* -fusion-max-dep-queries bounds all dependence checks of one candidate pair together */
+	void
+	startPair()
+	{
+		PairDepQueries = 0;
+	}
+
+	unsigned &
+	getPairDepQueries()
+	{
+		return PairDepQueries;
+	}
+
+	/* Steps that prepare a pair may change IR and still give up on it, so changes are tracked apart from fusions */
+	void
+	markIRModified()
+	{
+		IRModified = true;
+	}
+
+	/* Code in or around L1 and L2 changed outside of fuse(), so nothing ScalarEvolution derived for them stays valid */
+	void
+	markIRModified(const Loop *L1, const Loop *L2)
+	{
+		IRModified = true;
+		SE.forgetLoop(L1);
+		SE.forgetLoop(L2);
+		SE.forgetBlockAndLoopDispositions();
+	}
+
+	bool
+	isIRModified() const
+	{
+		return IRModified;
+	}
+
+	/* Built on first use and dropped whenever instructions move, nothing keeps it updated */
+	MemorySSA &
+	getMemorySSA(Function &F, AAResults &AA, DominatorTree &DT)
+	{
+		if (!MSSA)
+		{
+			PhaseScope Phase("memoryssa", "MemorySSA rebuild");
+			MSSA = std::make_unique<MemorySSA>(F, &AA, &DT);
+		}
+		return *MSSA;
+	}
+
+	void
+	invalidateMemorySSA()
+	{
+		MSSA.reset();
+	}
+
+private:
+	void
+	invalidate(const Loop *L)
+	{
+		LoopFactsMap.erase(L);
+		for (auto it = PairVerdicts.begin(), ite = PairVerdicts.end(); it != ite; ++it)
+		{
+			if (it->first.first == L || it->first.second == L)
+			{
+				PairVerdicts.erase(it);
+			}
+		}
+		for (auto it = Reported.begin(), ite = Reported.end(); it != ite; ++it)
+		{
+			if (it->first == L || it->second == L)
+			{
+				Reported.erase(it);
+			}
+		}
+	}
+
+	ScalarEvolution &SE;
+	const TargetTransformInfo &TTI;
+	LoopAccessInfoManager &LAIs;
+	DenseMap<const Loop *, std::unique_ptr<LoopFacts>> LoopFactsMap;
+	DenseMap<std::pair<const Loop *, const Loop *>, FusionBlocker> PairVerdicts;
+	DenseSet<std::pair<const Loop *, const Loop *>> Reported;
+	DenseSet<std::pair<const Loop *, const Loop *>> Counted;
+	DenseSet<std::pair<const Loop *, const Loop *>> RefusedPairs;
+	std::unique_ptr<MemorySSA> MSSA;
+	unsigned NumFused = 0;
+	bool IRModified = false;
+	unsigned PairDepQueries = 0;
+};
+
+void
+reportMissed(const Loop *L1, const Loop *L2, FusionBlocker Blocker, FusionCache &Cache, OptimizationRemarkEmitter &ORE)
+{
+	Cache.markRefused(L1, L2, true);
+	if (Cache.markReported(L1, L2) == false)
+	{
+		return;
+	}
+	ORE.emit([&]()
+	{
+		return OptimizationRemarkMissed(DEBUG_TYPE, BlockerDescriptions[Blocker].Name, L2->getStartLoc(), L2->getHeader())
+			<< "loop " << ore::NV("Loop", L2->getHeader()->getName())
+			<< " not fused with " << ore::NV("Previous", L1->getHeader()->getName())
+			<< ": " << ore::NV("Reason", BlockerDescriptions[Blocker].Message);
+	});
+} /* reportMissed */
+
+/* Reported once per function, the remaining pairs are left as they are */
+void
+reportFusionBudget(const Loop *L, FusionCache &Cache, OptimizationRemarkEmitter &ORE)
+{
+	if (Cache.markReported(nullptr, nullptr) == false)
+	{
+		return;
+	}
+	ORE.emit([&]()
+	{
+		return OptimizationRemarkMissed(DEBUG_TYPE, "FusionBudget", L->getStartLoc(), L->getHeader())
+			<< "no more loops fused in " << ore::NV("Function", L->getHeader()->getParent())
+			<< " after " << ore::NV("MaxFusions", unsigned(MaxFusionsPerFunction)) << " fusions";
+	});
+} /* reportFusionBudget */
+
+/* Dependences carried by a common outer loop keep their order, fusion only reorders iterations within one of its iterations */
+bool
+isCarriedByCommonLoop(const Dependence &Dep)
+{
+	for (unsigned Level = 1; Level <= Dep.getLevels(); Level++)
+	{
+		unsigned Direction = Dep.getDirection(Level);
+		if (Direction != Dependence::DVEntry::EQ)
+		{
+			return Direction == Dependence::DVEntry::LT;
+		}
+	}
+	return false;
+} /* isCarriedByCommonLoop */
+
+/* Bytes an access touches in one iteration of L: [Start + Step * k + Lo, Start + Step * k + Hi) */
+struct IterationFootprint
+{
+	const SCEV *Start;
+	const SCEV *Step;
+	const SCEV *Lo;
+	const SCEV *Hi;
+};
+
+std::optional<IterationFootprint>
+getIterationFootprint(Instruction *I, const Loop *L, ScalarEvolution &SE)
+{
+	Value *Ptr = getLoadStorePointerOperand(I);
+	if (!Ptr)
+	{
+		return std::nullopt;
+	}
+
+	const DataLayout &DL = I->getModule()->getDataLayout();
+	Type *IndexTy = DL.getIndexType(Ptr->getType());
+	const SCEV *Lo = SE.getZero(IndexTy);
+	const SCEV *Hi = SE.getConstant(IndexTy, DL.getTypeStoreSize(getLoadStoreType(I)).getFixedValue());
+
+	/* Loops inside L sweep a range around the address of the current iteration of L */
+	const SCEV *Start = SE.getSCEV(Ptr);
+	const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(Start);
+	while (AR && AR->getLoop() != L && L->contains(AR->getLoop()))
+	{
+		const SCEV *TripCount = SE.getBackedgeTakenCount(AR->getLoop());
+		if (!AR->isAffine() || isa<SCEVCouldNotCompute>(TripCount))
+		{
+			return std::nullopt;
+		}
+
+		const SCEV *Extent = SE.getMulExpr(SE.getTruncateOrZeroExtend(TripCount, IndexTy), AR->getStepRecurrence(SE));
+		if (!SE.isLoopInvariant(Extent, L))
+		{
+			return std::nullopt;
+		}
+		if (SE.isKnownNonNegative(Extent))
+		{
+			Hi = SE.getAddExpr(Hi, Extent);
+		}
+		else if (SE.isKnownNonPositive(Extent))
+		{
+			Lo = SE.getAddExpr(Lo, Extent);
+		}
+		else
+		{
+			return std::nullopt;
+		}
+		Start = AR->getStart();
+		AR = dyn_cast<SCEVAddRecExpr>(Start);
+	}
+
+	if (AR && AR->getLoop() == L)
+	{
+		if (!AR->isAffine())
+		{
+			return std::nullopt;
+		}
+		return IterationFootprint {AR->getStart(), AR->getStepRecurrence(SE), Lo, Hi};
+	}
+	if (SE.isLoopInvariant(Start, L))
+	{
+		return IterationFootprint {Start, SE.getZero(IndexTy), Lo, Hi};
+	}
+	return std::nullopt;
+} /* getIterationFootprint */
+
+/* Fusion runs iteration k of L2 before iterations k + t, t > Shift, of L1, where Shift is how many iterations L2 lags
+   behind. The dependence is kept if those never touch the same bytes: with equal strides it is enough to check
+   t = Shift + 1. Returns the smallest such Shift. Lead iterations of L1 run in a prologue before iteration 0 of the
+   fused loop */
+std::optional<uint64_t>
+getDependenceShift(Instruction *Src, const Loop *L1, Instruction *Dst, const Loop *L2, ScalarEvolution &SE, int64_t Lead = 0)
+{
+	std::optional<IterationFootprint> Footprint1 = getIterationFootprint(Src, L1, SE);
+	std::optional<IterationFootprint> Footprint2 = getIterationFootprint(Dst, L2, SE);
+	if (!Footprint1 || !Footprint2 || Footprint1->Step != Footprint2->Step)
+	{
+		return std::nullopt;
+	}
+
+	/* Every iteration of a loop invariant access touches the same bytes */
+	const SCEVConstant *Step = dyn_cast<SCEVConstant>(Footprint1->Step);
+	if (!Step || Step->isZero())
+	{
+		return std::nullopt;
+	}
+
+	const SCEV *Distance = SE.getMinusSCEV(Footprint1->Start, Footprint2->Start);
+	if (isa<SCEVCouldNotCompute>(Distance) || Distance->getType() != Step->getType())
+	{
+		return std::nullopt;
+	}
+	if (Lead)
+	{
+		Distance = SE.getAddExpr(Distance, SE.getMulExpr(SE.getConstant(Step->getType(), Lead, true), Step));
+	}
+
+	const SCEV *Gap;
+	if (Step->getAPInt().isNonNegative())
+	{
+		/* Iteration k + 1 of L1 starts above iteration k of L2 */
+		Gap = SE.getAddExpr(SE.getAddExpr(Distance, Step), SE.getMinusSCEV(Footprint1->Lo, Footprint2->Hi));
+	}
+	else
+	{
+		/* Iteration k + 1 of L1 ends below iteration k of L2 */
+		Gap = SE.getAddExpr(SE.getNegativeSCEV(SE.getAddExpr(Distance, Step)), SE.getMinusSCEV(Footprint2->Lo, Footprint1->Hi));
+	}
+	if (SE.isKnownNonNegative(Gap))
+	{
+		return 0;
+	}
+
+	/* Every iteration of lag widens the gap by one stride */
+	const SCEVConstant *ConstGap = dyn_cast<SCEVConstant>(Gap);
+	if (!ConstGap)
+	{
+		return std::nullopt;
+	}
+	APInt Shift = APIntOps::RoundingUDiv(-ConstGap->getAPInt(), Step->getAPInt().abs(), APInt::Rounding::UP);
+	return Shift.getLimitedValue();
+} /* getDependenceShift */
+
+/* Flow, anti and output dependences from L1 to L2 must not turn backward in the fused iteration space */
+bool
+isInvalidDependence(const Dependence &Dep, const Loop *L1, const Loop *L2, ScalarEvolution &SE, int64_t Lead = 0)
+{
+	if (Dep.isInput() || isCarriedByCommonLoop(Dep))
+	{
+		return false;
+	}
+	std::optional<uint64_t> Shift = getDependenceShift(Dep.getSrc(), L1, Dep.getDst(), L2, SE, Lead);
+	return !Shift || *Shift > 0;
+} /* isInvalidDependence */
+
+/* Largest lag of L2 any dependence from L1 to L2 needs. std::nullopt if some dependence needs more than MaxFusionShift */
+std::optional<uint64_t>
+getRequiredShift(const Loop *L1, const Loop *L2, FusionCache &Cache, ScalarEvolution &SE, AAResults &AA, DependenceInfo &DI)
+{
+	uint64_t Shift = 0;
+	bool Unshiftable = summariesHaveDependence(Cache.getFacts(L1).Accesses, Cache.getFacts(L2).Accesses, AA, DI, Cache.getPairDepQueries(),
+		[&](const Dependence &Dep)
+		{
+			if (Dep.isInput() || isCarriedByCommonLoop(Dep))
+			{
+				return false;
+			}
+			std::optional<uint64_t> DepShift = getDependenceShift(Dep.getSrc(), L1, Dep.getDst(), L2, SE);
+			if (!DepShift || *DepShift > MaxFusionShift)
+			{
+				return true;
+			}
+			Shift = std::max(Shift, *DepShift);
+			return false;
+		}
+	);
+	if (Unshiftable)
+	{
+		return std::nullopt;
+	}
+	return Shift;
+} /* getRequiredShift */
+
+/* The first dependence found is reported as the analysis behind the missed remark. Lead iterations of L1 are peeled
+   into a prologue */
+bool
+loopsHaveInvalidDependencies(const Loop *L1, const Loop *L2, int64_t Lead, FusionCache &Cache, ScalarEvolution &SE, AAResults &AA,
+	DependenceInfo &DI, OptimizationRemarkEmitter &ORE)
+{
+	const AccessSummary &Summary1 = Cache.getFacts(L1).Accesses;
+	const AccessSummary &Summary2 = Cache.getFacts(L2).Accesses;
+
+	bool OutOfBudget = false;
+	bool Invalid = summariesHaveDependence(Summary1, Summary2, AA, DI, Cache.getPairDepQueries(),
+		[&](const Dependence &Dep)
+		{
+			if (isInvalidDependence(Dep, L1, L2, SE, Lead) == false)
+			{
+				return false;
+			}
+			ORE.emit([&]()
+			{
+				return OptimizationRemarkAnalysis(DEBUG_TYPE, "Dependence", Dep.getDst())
+					<< ore::NV("Destination", Dep.getDst()) << " in loop " << ore::NV("Loop", L2->getHeader()->getName())
+					<< " depends on " << ore::NV("Source", Dep.getSrc()) << " in loop " << ore::NV("Previous", L1->getHeader()->getName())
+					<< " of a later iteration";
+			});
+			return true;
+		},
+		&OutOfBudget
+	);
+	if (OutOfBudget)
+	{
+		ORE.emit([&]()
+		{
+			return OptimizationRemarkAnalysis(DEBUG_TYPE, "DependenceBudget", L2->getStartLoc(), L2->getHeader())
+				<< "loops " << ore::NV("Previous", L1->getHeader()->getName()) << " and " << ore::NV("Loop", L2->getHeader()->getName())
+				<< " assumed dependent after " << ore::NV("Queries", unsigned(MaxFusionDepQueries)) << " dependence queries";
+		});
+	}
+	return Invalid;
+} /* loopsHaveInvalidDependencies */
+
+/* Accesses of L1 and L2 may overlap only within one iteration of the fused loop */
+bool
+isCarriedByFusedLoop(const Dependence &Dep, const Loop *L1, const Loop *L2, ScalarEvolution &SE)
+{
+	if (Dep.isInput() || isCarriedByCommonLoop(Dep))
+	{
+		return false;
+	}
+	return getDependenceShift(Dep.getSrc(), L1, Dep.getDst(), L2, SE) != 0
+		|| getDependenceShift(Dep.getDst(), L2, Dep.getSrc(), L1, SE) != 0;
+} /* isCarriedByFusedLoop */
+
+/* llvm.loop.parallel_accesses promises no dependences carried by the loop. It holds for the fused loop if it held for
+   both loops and nothing new is carried between the bodies */
+bool
+bodiesStayParallel(const Loop *L1, const Loop *L2, FusionCache &Cache, ScalarEvolution &SE, AAResults &AA, DependenceInfo &DI)
+{
+	if (!L1->isAnnotatedParallel() || !L2->isAnnotatedParallel())
+	{
+		return false;
+	}
+	PhaseScope Phase("dependences", "Dependence checks");
+	return !summariesHaveDependence(Cache.getFacts(L1).Accesses, Cache.getFacts(L2).Accesses, AA, DI, Cache.getPairDepQueries(),
+		[&](const Dependence &Dep)
+		{
+			return isCarriedByFusedLoop(Dep, L1, L2, SE);
+		}
+	);
+} /* bodiesStayParallel */
+
+/* Named properties of a loop ID, other operands (debug locations) are skipped */
+MapVector<StringRef, MDNode *>
+getLoopProperties(MDNode *LoopID)
+{
+	MapVector<StringRef, MDNode *> Properties;
+	if (!LoopID)
+	{
+		return Properties;
+	}
+	for (const MDOperand &Op : drop_begin(LoopID->operands()))
+	{
+		MDNode *Property = dyn_cast<MDNode>(Op);
+		if (!Property || Property->getNumOperands() == 0)
+		{
+			continue;
+		}
+		if (const MDString *Name = dyn_cast<MDString>(Property->getOperand(0)))
+		{
+			Properties[Name->getString()] = Property;
+		}
+	}
+	return Properties;
+} /* getLoopProperties */
+
+/* A hint that keeps a transformation away from the loop. Fusion must not hand such a body to that transformation */
+bool
+isRestrictingProperty(const MDNode *Property)
+{
+	StringRef Name = cast<MDString>(Property->getOperand(0))->getString();
+	if (Name.ends_with(".disable") || Name == "llvm.loop.disable_nonforced")
+	{
+		return true;
+	}
+
+	const ConstantInt *Value = Property->getNumOperands() == 2 ? mdconst::dyn_extract<ConstantInt>(Property->getOperand(1)) : nullptr;
+	if (!Value)
+	{
+		return false;
+	}
+	if (Name.ends_with(".enable"))
+	{
+		return Value->isZero();
+	}
+	if (Name == "llvm.loop.vectorize.width" || Name == "llvm.loop.interleave.count" || Name == "llvm.loop.unroll.count")
+	{
+		return Value->isOne();
+	}
+	return false;
+} /* isRestrictingProperty */
+
+/* Loop ID of the fused loop:
+   - a property both loops have with the same operands is kept;
+   - llvm.loop.mustprogress of either loop is kept, both trip counts are computable so the fused loop terminates;
+   - access groups of llvm.loop.parallel_accesses are united only if the bodies stay parallel, otherwise dropped;
+   - a restricting hint of either loop is kept, restrictions win over conflicting enabling hints;
+   - any other property, set in one loop only or with different operands, is dropped.
+   Debug locations are taken from L1 */
+MDNode *
+mergeLoopIDs(const Loop *L1, const Loop *L2, bool Parallel)
+{
+	MDNode *LoopID1 = L1->getLoopID();
+	MDNode *LoopID2 = L2->getLoopID();
+	if (!LoopID1 && !LoopID2)
+	{
+		return nullptr;
+	}
+
+	LLVMContext &Ctx = L1->getHeader()->getContext();
+	MapVector<StringRef, MDNode *> Properties1 = getLoopProperties(LoopID1);
+	MapVector<StringRef, MDNode *> Properties2 = getLoopProperties(LoopID2);
+
+	/* The first operand refers to the node itself */
+	SmallVector<Metadata *, 8> Operands = {nullptr};
+	if (LoopID1)
+	{
+		for (const MDOperand &Op : drop_begin(LoopID1->operands()))
+		{
+			if (isa<DILocation>(Op))
+			{
+				Operands.push_back(Op);
+			}
+		}
+	}
+
+	const StringRef ParallelAccesses = "llvm.loop.parallel_accesses";
+	if (Parallel)
+	{
+		SmallSetVector<Metadata *, 8> Groups;
+		Groups.insert(MDString::get(Ctx, ParallelAccesses));
+		for (MDNode *Property : {Properties1.lookup(ParallelAccesses), Properties2.lookup(ParallelAccesses)})
+		{
+			if (Property)
+			{
+				for (const MDOperand &Group : drop_begin(Property->operands()))
+				{
+					Groups.insert(Group);
+				}
+			}
+		}
+		if (Groups.size() > 1)
+		{
+			Operands.push_back(MDNode::get(Ctx, Groups.getArrayRef()));
+		}
+	}
+
+	SmallPtrSet<const MDNode *, 8> Kept;
+	auto keep = [&](MDNode *Property)
+	{
+		if (Kept.insert(Property).second)
+		{
+			Operands.push_back(Property);
+		}
+	};
+	for (const auto &[Name, Property1] : Properties1)
+	{
+		MDNode *Property2 = Properties2.lookup(Name);
+		if (Name == ParallelAccesses)
+		{
+			continue;
+		}
+		if (Property1 == Property2 || Name == "llvm.loop.mustprogress" || isRestrictingProperty(Property1))
+		{
+			keep(Property1);
+		}
+	}
+	for (const auto &[Name, Property2] : Properties2)
+	{
+		if (Name == ParallelAccesses)
+		{
+			continue;
+		}
+		if ((Name == "llvm.loop.mustprogress" && !Properties1.count(Name)) || isRestrictingProperty(Property2))
+		{
+			keep(Property2);
+		}
+	}
+
+	if (Operands.size() == 1)
+	{
+		return nullptr;
+	}
+	MDNode *LoopID = MDNode::getDistinct(Ctx, Operands);
+	LoopID->replaceOperandWith(0, LoopID);
+	return LoopID;
+} /* mergeLoopIDs */
+
+bool
+areLoopsAdjacent(const Loop *L1, const Loop *L2)
+{
+	BasicBlock *Exit1 = L1->getExitBlock();
+	assert(Exit1 && "Loop 1 has no exit block");
+	if (Exit1 != L2->getLoopPreheader())
+	{
+		return false;
+	}
+	
+	if (Exit1->size() > 1)
+	{
+		return false;
+	}
+	return true;
+} /* areLoopsAdjacent */
+
+/* Do I and J touch memory that may overlap, at any iteration of the loops they belong to */
+bool
+accessesMayAlias(const Instruction &I, const Instruction &J, AAResults &AA)
+{
+	std::optional<MemoryLocation> Loc1 = MemoryLocation::getOrNone(&I);
+	std::optional<MemoryLocation> Loc2 = MemoryLocation::getOrNone(&J);
+	if (!Loc1 || !Loc2)
+	{
+		return true;
+	}
+	return !AA.isNoAlias(MemoryLocation::getBeforeOrAfter(Loc1->Ptr), MemoryLocation::getBeforeOrAfter(Loc2->Ptr));
+} /* accessesMayAlias */
+
+bool
+mayNotReturn(const Instruction &I)
+{
+	return I.mayThrow() || !I.willReturn();
+} /* mayNotReturn */
+
+/* Can the order of I and J be swapped without changing what either of them sees */
+bool
+instructionsConflict(const Instruction &I, const Instruction &J, AAResults &AA)
+{
+	if (is_contained(J.operands(), &I) || is_contained(I.operands(), &J))
+	{
+		return true;
+	}
+	if ((mayNotReturn(I) && J.mayHaveSideEffects()) || (mayNotReturn(J) && I.mayHaveSideEffects()))
+	{
+		return true;
+	}
+	if (!I.mayReadOrWriteMemory() || !J.mayReadOrWriteMemory())
+	{
+		return false;
+	}
+	if (!I.mayWriteToMemory() && !J.mayWriteToMemory())
+	{
+		return false;
+	}
+	return accessesMayAlias(I, J, AA);
+} /* instructionsConflict */
+
+/* Memory and side effect conflicts of I with L. LoopIsAbove tells whether L currently executes before I */
+bool
+instructionConflictsWithLoop(Instruction &I, const Loop &L, bool LoopIsAbove, MemorySSA &MSSA, AAResults &AA)
+{
+	if (!I.mayReadOrWriteMemory() && !mayNotReturn(I))
+	{
+		return false;
+	}
+
+	/* A plain read whose clobber lies outside of the loop above it is not written by that loop */
+	if (LoopIsAbove && isa<LoadInst>(I) && !mayNotReturn(I))
+	{
+		if (MemoryUseOrDef *Access = MSSA.getMemoryAccess(&I))
+		{
+			MemoryAccess *Clobber = MSSA.getWalker()->getClobberingMemoryAccess(Access);
+			if (MSSA.isLiveOnEntryDef(Clobber) || !L.contains(Clobber->getBlock()))
+			{
+				return false;
+			}
+		}
+	}
+
+	for (BasicBlock *BB : L.blocks())
+	{
+		const MemorySSA::AccessList *Accesses = MSSA.getBlockAccesses(BB);
+		if (!Accesses)
+		{
+			continue;
+		}
+		for (const MemoryAccess &Access : *Accesses)
+		{
+			const auto *UseOrDef = dyn_cast<MemoryUseOrDef>(&Access);
+			if (!UseOrDef)
+			{
+				continue;
+			}
+			Instruction *LoopI = UseOrDef->getMemoryInst();
+			if (mayNotReturn(I) && isa<MemoryDef>(UseOrDef))
+			{
+				return true;
+			}
+			if (!I.mayReadOrWriteMemory() || (!I.mayWriteToMemory() && !isa<MemoryDef>(UseOrDef)))
+			{
+				continue;
+			}
+			if (accessesMayAlias(I, *LoopI, AA))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+} /* instructionConflictsWithLoop */
+
+/* Straight-line blocks from Exit of L1 to PreHeader of L2. Empty if there is any branching or merging between the loops */
+SmallVector<BasicBlock *, 8>
+getInterferingBlocks(const Loop *L1, const Loop *L2)
+{
+	SmallVector<BasicBlock *, 8> Chain;
+	BasicBlock *PreHeader2 = L2->getLoopPreheader();
+	SmallPtrSet<BasicBlock *, 8> Visited;
+	for (BasicBlock *BB = L1->getExitBlock(); BB; BB = BB->getSingleSuccessor())
+	{
+		if (!Visited.insert(BB).second || !isa<BranchInst>(BB->getTerminator()) || !BB->phis().empty())
+		{
+			return {};
+		}
+		if (!Chain.empty() && BB->getSinglePredecessor() != Chain.back())
+		{
+			return {};
+		}
+		Chain.push_back(BB);
+		if (BB == PreHeader2)
+		{
+			return Chain;
+		}
+	}
+	return {};
+} /* getInterferingBlocks */
+
+/* Hoist every instruction between the loops above L1 or sink it below L2, then drop the emptied blocks */
+bool
+tryMoveInterferingCode(Loop *L1, Loop *L2, LoopInfo &LI, DomTreeUpdater &DTU, FusionCache &Cache, AAResults &AA)
+{
+	enum { Up = 0b10, Down = 0b01 };
+	MapVector<Instruction *, int> WaysToMove; /* 10 - up; 01 - down; 11 both; 00 - can't move */
+	BasicBlock *Exit1 = L1->getExitBlock();
+	BasicBlock *PreHeader2 = L2->getLoopPreheader();
+
+	assert(Exit1 != PreHeader2 
+		&& Exit1->getSingleSuccessor() != PreHeader2 
+		&& "No complex interfering code here");
+
+	SmallVector<BasicBlock *, 8> Chain = getInterferingBlocks(L1, L2);
+	if (Chain.empty())
+	{
+		return false;
+	}
+
+	MemorySSA &MSSA = Cache.getMemorySSA(*Exit1->getParent(), AA, DTU.getDomTree());
+	for (BasicBlock *BB : Chain)
+	{
+		for (Instruction &I : *BB)
+		{
+			if (&I == BB->getTerminator())
+			{
+				break;
+			}
+			int Ways = Up | Down;
+			for (Value *V : I.operands())
+			{
+				if (auto *Def = dyn_cast<Instruction>(V); Def && L1->contains(Def))
+				{
+					Ways &= Down;
+				}
+			}
+			for (User *U : I.users())
+			{
+				if (L2->contains(cast<Instruction>(U)) || isa<PHINode>(U))
+				{
+					Ways &= Up;
+				}
+			}
+			if ((Ways & Up) && instructionConflictsWithLoop(I, *L1, true, MSSA, AA))
+			{
+				Ways &= Down;
+			}
+			if ((Ways & Down) && instructionConflictsWithLoop(I, *L2, false, MSSA, AA))
+			{
+				Ways &= Up;
+			}
+			if (Ways == 0b00)
+			{
+				return false;
+			}
+			WaysToMove.insert(std::make_pair(&I, Ways));
+		}
+	}
+
+	/* Prefer hoisting. An instruction that goes down must not be overtaken by a later conflicting one that goes up */
+	MapVector<Instruction *, int> Direction;
+	for (auto &[I, Ways] : WaysToMove)
+	{
+		Direction[I] = (Ways & Up) ? Up : Down;
+	}
+	bool Changed = true;
+	for (unsigned Pass = 0; Changed; Pass++)
+	{
+		if (Pass > WaysToMove.size())
+		{
+			return false;
+		}
+		Changed = false;
+		for (auto it1 = Direction.begin(), ite = Direction.end(); it1 != ite; ++it1)
+		{
+			if (it1->second != Down)
+			{
+				continue;
+			}
+			for (auto it2 = std::next(it1); it2 != ite; ++it2)
+			{
+				if (it2->second != Up || !instructionsConflict(*it1->first, *it2->first, AA))
+				{
+					continue;
+				}
+				if (WaysToMove[it2->first] & Down)
+				{
+					it2->second = Down;
+				}
+				else if (WaysToMove[it1->first] & Up)
+				{
+					it1->second = Up;
+					Changed = true;
+					break;
+				}
+				else
+				{
+					return false;
+				}
+				Changed = true;
+			}
+		}
+	}
+
+	/* Keep the original order within each direction */
+	Instruction *PreHeader1Term = L1->getLoopPreheader()->getTerminator();
+	Instruction *Exit2Start = &*L2->getExitBlock()->getFirstInsertionPt();
+	for (auto &[I, Dir] : Direction)
+	{
+		I->moveBefore(Dir == Up ? PreHeader1Term : Exit2Start);
+	}
+	Cache.invalidateMemorySSA();
+
+	/* Only branches are left, link Exit of L1 straight to PreHeader of L2 */
+	SmallVector<DominatorTree::UpdateType, 8> TreeUpdates;
+	replaceSuccessor(Exit1, Chain[1], PreHeader2, TreeUpdates);
+	for (BasicBlock *BB : make_range(std::next(Chain.begin()), std::prev(Chain.end())))
+	{
+		recordSuccessorsRemoval(BB, TreeUpdates);
+		LI.removeBlock(BB);
+	}
+	DTU.applyUpdates(TreeUpdates);
+	for (BasicBlock *BB : make_range(std::next(Chain.begin()), std::prev(Chain.end())))
+	{
+		DTU.deleteBB(BB);
+	}
+	DTU.flush();
+	return true;
+} /* tryMoveInterferingCode */
+
+bool
+tryCleanPreHeader(Loop *L1, Loop *L2, DominatorTree &DT, FusionCache &Cache, AAResults &AA)
+{
+	DenseMap<Instruction *, int> WaysToMove; /* 10 - up; 01 - down; 11 both; 00 - can't move */
+
+	BasicBlock *Exit1 = L1->getExitBlock();
+	BasicBlock *PreHeader2 = L2->getLoopPreheader();
+	if (Exit1 != PreHeader2) assert(Exit1->size() == 1 && Exit1->getSingleSuccessor() == PreHeader2);
+
+	/* Flow, anti and output dependences all forbid crossing a loop */
+	MemorySSA &MSSA = Cache.getMemorySSA(*PreHeader2->getParent(), AA, DT);
+	for (Instruction &I : *PreHeader2)
+	{
+		if (&I == PreHeader2->getTerminator())
+		{
+			break;
+		}
+		WaysToMove.insert(std::make_pair(&I, 0b11));
+		if (instructionConflictsWithLoop(I, *L1, true, MSSA, AA))
+		{
+			WaysToMove[&I] &= 0b01;
+		}
+		if (instructionConflictsWithLoop(I, *L2, false, MSSA, AA))
+		{
+			WaysToMove[&I] &= 0b10;
+		}
+		for (BasicBlock *L1BB : L1->blocks())
+		{
+			for (Value *V : I.operands())
+			{
+				if (blockProducesValue(L1BB, V))
+				{
+					WaysToMove[&I] &= 0b01;
+				}
+			}
+		}
+
+		for (BasicBlock *L2BB : L2->blocks())
+		{
+			if (blockUsesValue(L2BB, &I))
+			{
+				WaysToMove[&I] &= 0b10;
+			}
+		}
+		if (WaysToMove.at(&I) == 0b00)
+		{
+			return false;
+		}
+	}
+
+	BasicBlock *PreHeader1 = L1->getLoopPreheader();
+	Instruction *PreHeader1Term = PreHeader1->getTerminator();
+	int move = 0b11;
+	for (auto &pair : WaysToMove)
+	{
+		move &= pair.second;
+	}
+
+	/* Move entire set of instructions up or down */
+	Cache.invalidateMemorySSA();
+	if (move & 0b10)
+	{
+		while (&*(PreHeader2->begin()) != PreHeader2->getTerminator())
+		{
+			(&*(PreHeader2->begin()))->moveBefore(PreHeader1Term);
+		}
+	}
+	else if (move & 0b01)
+	{
+		Instruction *Exit2Start = &*(L2->getExitBlock()->begin());
+		while (&*(PreHeader2->begin()) != PreHeader2->getTerminator())
+		{
+			(&*(PreHeader2->begin()))->moveBefore(Exit2Start);
+		}
+	}
+	else
+	{
+		return false;
+	}
+	assert(PreHeader2->size() == 1 && "Incorrect PreHeader cleaning");
+	return true;
+} /* tryCleanPreHeader */
+
+bool
+tryCleanExit(Loop *L1, Loop *L2)
+{
+	BasicBlock *Exit1 = L1->getExitBlock();
+	BasicBlock *PreHeader2 = L2->getLoopPreheader();
+	if (Exit1 == PreHeader2)
+	{
+		return true;
+	}
+
+	assert(Exit1->getSingleSuccessor() == PreHeader2);
+
+	while (&*(Exit1->begin()) != Exit1->getTerminator())
+	{
+		(&*(Exit1->begin()))->moveBefore(&*(PreHeader2->begin()));
+	}
+	/* For now always returns true */
+	return true;
+} /* tryCleanExit */
+
+bool
+tryCleanExitAndPreHeader(Loop *L1, Loop *L2, DominatorTree &DT, FusionCache &Cache, AAResults &AA)
+{
+	if (tryCleanExit(L1, L2) == false)
+	{
+		return false;
+	}
+	/* Code of Exit1 now sits in PreHeader2, MemorySSA still places it in Exit1 */
+	Cache.invalidateMemorySSA();
+	return tryCleanPreHeader(L1, L2, DT, Cache, AA);
+} /* tryCleanExitAndPreHeader */
+
+/* Identical instructions use the same SSA operands. One that reads memory may see what L1 stores between the guards */
+bool
+haveSameCondition(const BranchInst &Guard1, const BranchInst &Guard2)
+{
+	const Value *Cond1 = Guard1.getCondition();
+	const Value *Cond2 = Guard2.getCondition();
+	if (Cond1 == Cond2)
+	{
+		return true;
+	}
+	const Instruction *I1 = dyn_cast<Instruction>(Cond1);
+	const Instruction *I2 = dyn_cast<Instruction>(Cond2);
+	return I1 && I2 && !I1->mayReadOrWriteMemory() && I1->isIdenticalTo(I2);
+} /* haveSameCondition */
+
+/* Guard of L1 skips straight past L2, so the guard of L2 becomes an unconditional branch into its preheader.
+   Phis merging the skipped and the executed path of L1 move below L2 */
+bool
+mergeLoopGuards(Loop *L1, Loop *L2, DomTreeUpdater &DTU)
+{
+	BranchInst *Guard1 = L1->getLoopGuardBranch();
+	BranchInst *Guard2 = L2->getLoopGuardBranch();
+	if (!Guard1 && !Guard2)
+	{
+		return true;
+	}
+	if (!Guard1 || !Guard2)
+	{
+		return false;
+	}
+
+	BasicBlock *GuardBB1 = Guard1->getParent();
+	BasicBlock *PreHeader1 = L1->getLoopPreheader();
+	BasicBlock *PreHeader2 = L2->getLoopPreheader();
+	BasicBlock *Skip1 = Guard1->getSuccessor(0) == PreHeader1 ? Guard1->getSuccessor(1) : Guard1->getSuccessor(0);
+	BasicBlock *Skip2 = Guard2->getSuccessor(0) == PreHeader2 ? Guard2->getSuccessor(1) : Guard2->getSuccessor(0);
+	if (Guard2->getParent() != Skip1
+		|| (Guard1->getSuccessor(0) == PreHeader1) != (Guard2->getSuccessor(0) == PreHeader2)
+		|| haveSameCondition(*Guard1, *Guard2) == false
+		|| !Skip1->hasNPredecessors(2)
+		|| !Skip2->hasNPredecessors(2))
+	{
+		return false;
+	}
+
+	/* Anything else between the guards would stop running when L1 is skipped */
+	Instruction *Cond2 = dyn_cast<Instruction>(Guard2->getCondition());
+	for (Instruction &I : *Skip1)
+	{
+		if (isa<PHINode>(I) || &I == Guard2)
+		{
+			continue;
+		}
+		if (&I != Cond2 || !I.hasOneUse())
+		{
+			return false;
+		}
+	}
+
+	BasicBlock *Ran1 = nullptr;
+	for (BasicBlock *Pred : predecessors(Skip1))
+	{
+		if (Pred != GuardBB1)
+		{
+			Ran1 = Pred;
+		}
+	}
+	BasicBlock *Ran2 = nullptr;
+	for (BasicBlock *Pred : predecessors(Skip2))
+	{
+		if (Pred != Skip1)
+		{
+			Ran2 = Pred;
+		}
+	}
+
+	DominatorTree &DT = DTU.getDomTree();
+	for (PHINode &Phi : make_early_inc_range(Skip1->phis()))
+	{
+		Value *Ran = Phi.getIncomingValueForBlock(Ran1);
+		Value *Skipped = Phi.getIncomingValueForBlock(GuardBB1);
+		PHINode *Merge = nullptr;
+		for (Use &U : make_early_inc_range(Phi.uses()))
+		{
+			Instruction *User = cast<Instruction>(U.getUser());
+			PHINode *UserPhi = dyn_cast<PHINode>(User);
+			BasicBlock *UseBB = UserPhi ? UserPhi->getIncomingBlock(U) : User->getParent();
+			if (UseBB == Skip1 && UserPhi && UserPhi->getParent() == Skip2)
+			{
+				/* The edge from Skip1 becomes the edge from the guard of L1 */
+				U.set(Skipped);
+			}
+			else if (DT.dominates(PreHeader2, UseBB))
+			{
+				U.set(Ran);
+			}
+			else
+			{
+				if (!Merge)
+				{
+					Merge = PHINode::Create(Phi.getType(), 2, Phi.getName() + ".guard");
+					Merge->insertBefore(Skip2->getFirstNonPHI());
+					Merge->addIncoming(Ran, Ran2);
+					Merge->addIncoming(Skipped, GuardBB1);
+				}
+				U.set(Merge);
+			}
+		}
+		Phi.eraseFromParent();
+	}
+
+	SmallVector<DominatorTree::UpdateType, 8> TreeUpdates;
+	replaceSuccessor(GuardBB1, Skip1, Skip2, TreeUpdates);
+	Skip2->replacePhiUsesWith(Skip1, GuardBB1);
+
+	TreeUpdates.push_back({DominatorTree::Delete, Skip1, Skip2});
+	Guard2->eraseFromParent();
+	BranchInst::Create(PreHeader2, Skip1);
+	if (Cond2 && Cond2->getParent() == Skip1)
+	{
+		Cond2->eraseFromParent();
+	}
+
+	DTU.applyUpdates(TreeUpdates);
+	DTU.flush();
+	return true;
+} /* mergeLoopGuards */
+
+bool
+tryMakeLoopsAdjacent(Loop *L1, Loop *L2, LoopInfo &LI, DomTreeUpdater &DTU, FusionCache &Cache, AAResults &AA,
+	OptimizationRemarkEmitter &ORE)
+{
+	PhaseScope Phase("adjacency", "Making loops adjacent");
+	if (areLoopsAdjacent(L1, L2))
+	{
+		return true;
+	}
+
+	/* Rotated loops leave through LCSSA phis, fuse() forms them again for the fused loop */
+	if (L1->isRotatedForm())
+	{
+		bool Guarded = L1->getLoopGuardBranch() != nullptr;
+		if (mergeLoopGuards(L1, L2, DTU) == false)
+		{
+			reportMissed(L1, L2, FB_GuardsDiffer, Cache, ORE);
+			return false;
+		}
+		if (FoldSingleEntryPHINodes(L1->getExitBlock()) || Guarded)
+		{
+			Cache.markIRModified(L1, L2);
+		}
+		Cache.invalidateMemorySSA();
+	}
+
+	BasicBlock *Exit1 = L1->getExitBlock();
+	BasicBlock *PreHeader2 = L2->getLoopPreheader();
+
+	/* Check if loops have more than 2 control-flow equivalent Basic Blocks between them */
+	if (Exit1 != PreHeader2 && Exit1->getSingleSuccessor() != PreHeader2)
+	{
+		if (tryMoveInterferingCode(L1, L2, LI, DTU, Cache, AA) == false)
+		{
+			reportMissed(L1, L2, FB_InterferingCode, Cache, ORE);
+			return false;
+		}
+		Cache.markIRModified(L1, L2);
+	}
+
+	/* Remove important instructions from BB between loops if possible */
+	if (Exit1->size() > 1 || PreHeader2->size() > 1)
+	{
+		/* Exit1 is emptied into PreHeader2 even if PreHeader2 cannot be cleaned afterwards */
+		if (Exit1 != PreHeader2 && Exit1->size() > 1)
+		{
+			Cache.markIRModified(L1, L2);
+		}
+		if (tryCleanExitAndPreHeader(L1, L2, DTU.getDomTree(), Cache, AA) == false)
+		{
+			reportMissed(L1, L2, FB_CodeBetweenLoops, Cache, ORE);
+			return false;
+		}
+		Cache.markIRModified(L1, L2);
+	}
+
+	/* Combine Exit and PreHeader into one BB */
+	if (Exit1->getSingleSuccessor() == PreHeader2)
+	{
+		Cache.markIRModified(L1, L2);
+		SmallVector<DominatorTree::UpdateType, 8> TreeUpdates;
+		redirectPredecessors(Exit1, PreHeader2, TreeUpdates);
+		recordSuccessorsRemoval(Exit1, TreeUpdates);
+
+		LI.removeBlock(Exit1);
+		DTU.applyUpdates(TreeUpdates);
+		DTU.deleteBB(Exit1);
+		DTU.flush();
+	}
+	Cache.invalidateMemorySSA();
+
+	/* Final check before return */
+	if (L1->getExitBlock() == L2->getLoopPreheader() && L2->getLoopPreheader()->size() == 1)
+	{
+		return true;
+	}
+
+	reportMissed(L1, L2, FB_NotAdjacent, Cache, ORE);
+	return false;
+} /* tryMakeLoopsAdjacent */
+
+bool
+loopHasLiveOuts(const Loop &L)
+{
+	for (const BasicBlock *BB : L.blocks())
+	{
+		for (const Instruction &I : *BB)
+		{
+			for (const User *U : I.users())
+			{
+				if (!L.contains(cast<Instruction>(U)))
+				{
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+} /* loopHasLiveOuts */
+
+const SCEVAddRecExpr *
+getIndexRecurrence(const Loop *L, ScalarEvolution &SE)
+{
+	PHINode *Index = getIndex(*L->getHeader());
+	if (!Index)
+	{
+		return nullptr;
+	}
+
+	const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Index));
+	if (!AR || AR->getLoop() != L || !AR->isAffine() || !isa<SCEVConstant>(AR->getStepRecurrence(SE)))
+	{
+		return nullptr;
+	}
+	return AR;
+} /* getIndexRecurrence */
+
+/* fuse() replaces the index of L2 with the index of L1, so both must walk the same values */
+bool
+haveSameIndex(const Loop *L1, const Loop *L2, ScalarEvolution &SE)
+{
+	const SCEVAddRecExpr *Index1 = getIndexRecurrence(L1, SE);
+	const SCEVAddRecExpr *Index2 = getIndexRecurrence(L2, SE);
+	return Index1 && Index2
+		&& Index1->getStart() == Index2->getStart()
+		&& Index1->getStepRecurrence(SE) == Index2->getStepRecurrence(SE);
+} /* haveSameIndex */
+
+/* Only the body between the header and the latch is cloned, so the header must be the only exit */
+bool
+canPeelEpilogue(const Loop *L)
+{
+	const BasicBlock *Header = L->getHeader();
+	const BasicBlock *BodyEntry = getBodyEntry(*L);
+	return L->isInnermost()
+		&& L->getExitingBlock() == Header
+		&& BodyEntry
+		&& BodyEntry->phis().empty()
+		&& loopHasLiveOuts(*L) == false;
+} /* canPeelEpilogue */
+
+/* Header holds nothing but phis and the exit test, so the cloned body refers to no other header value */
+bool
+canPeelPrologue(const Loop *L)
+{
+	const BasicBlock *Header = L->getHeader();
+	if (canPeelEpilogue(L) == false)
+	{
+		return false;
+	}
+	for (const Instruction &I : *Header)
+	{
+		if (!isa<PHINode>(I) && &I != Header->getTerminator() && &I != getExitCompare(*Header))
+		{
+			return false;
+		}
+	}
+	return true;
+} /* canPeelPrologue */
+
+/* Iterations L1 runs before its index reaches the start of the index of L2. They are peeled into a prologue, so the
+   fused loop starts where L2 starts */
+std::optional<int64_t>
+getIndexOffset(const Loop *L1, const Loop *L2, ScalarEvolution &SE)
+{
+	const SCEVAddRecExpr *Index1 = getIndexRecurrence(L1, SE);
+	const SCEVAddRecExpr *Index2 = getIndexRecurrence(L2, SE);
+	if (!Index1 || !Index2 || Index1->getType() != Index2->getType()
+		|| Index1->getStepRecurrence(SE) != Index2->getStepRecurrence(SE))
+	{
+		return std::nullopt;
+	}
+	if (Index1->getStart() == Index2->getStart())
+	{
+		return 0;
+	}
+
+	const auto *Distance = dyn_cast<SCEVConstant>(SE.getMinusSCEV(Index2->getStart(), Index1->getStart()));
+	const APInt &Step = cast<SCEVConstant>(Index1->getStepRecurrence(SE))->getAPInt();
+	if (!Distance || Step.isZero() || !Distance->getAPInt().srem(Step).isZero())
+	{
+		return std::nullopt;
+	}
+	APInt Iterations = Distance->getAPInt().sdiv(Step);
+	if (Iterations.isNonPositive() || Iterations.ugt(MaxFusionPeel) || canPeelPrologue(L1) == false)
+	{
+		return std::nullopt;
+	}
+	return Iterations.getSExtValue();
+} /* getIndexOffset */
+
+/* How many iterations L1 runs more than L2 once the prologue of getIndexOffset is peeled, if ScalarEvolution proves it
+   constant and the rest can be peeled */
+std::optional<int64_t>
+getPeelableDifference(const Loop *L1, const Loop *L2, ScalarEvolution &SE)
+{
+	const SCEV *TripCount1 = SE.getBackedgeTakenCount(L1);
+	const SCEV *TripCount2 = SE.getBackedgeTakenCount(L2);
+	if (isa<SCEVCouldNotCompute>(TripCount1) || isa<SCEVCouldNotCompute>(TripCount2)
+		|| TripCount1->getType() != TripCount2->getType())
+	{
+		return std::nullopt;
+	}
+
+	const SCEVConstant *Difference = dyn_cast<SCEVConstant>(SE.getMinusSCEV(TripCount1, TripCount2));
+	if (!Difference || Difference->getAPInt().getSignificantBits() > 64)
+	{
+		return std::nullopt;
+	}
+	/* After the prologue both indices walk the same values, so the common range is aligned */
+	std::optional<int64_t> Offset = getIndexOffset(L1, L2, SE);
+	if (!Offset)
+	{
+		return std::nullopt;
+	}
+	/* The prologue has no exit test, so L1 must run at least that many iterations */
+	if (*Offset && !SE.isKnownPredicate(ICmpInst::ICMP_UGE, TripCount1, SE.getConstant(TripCount1->getType(), *Offset - 1)))
+	{
+		return std::nullopt;
+	}
+	int64_t Iterations = Difference->getAPInt().getSExtValue() - *Offset;
+	if ((Iterations == 0 && *Offset == 0) || Iterations > MaxFusionPeel || -Iterations > MaxFusionPeel)
+	{
+		return std::nullopt;
+	}
+
+	if (Iterations && canPeelEpilogue(Iterations > 0 ? L1 : L2) == false)
+	{
+		return std::nullopt;
+	}
+	return Iterations;
+} /* getPeelableDifference */
+
+/* Iterations of a loop cloned before fusion: an epilogue linked after the fused loop or a prologue run before L1 */
+struct PeeledIterations
+{
+	BasicBlock *Entry = nullptr;
+	BasicBlock *Last = nullptr;
+	SmallVector<BasicBlock *, 16> Blocks;
+	SmallVector<std::pair<PHINode *, Value *>, 4> PhiValues; /* Header phis' values after the last cloned iteration */
+};
+
+/* Clone Count iterations of the body of L. They start from the header phis' values at the loop exit, or at the loop
+   entry if FromPreHeader is set */
+PeeledIterations
+cloneIterations(Loop *L, unsigned Count, bool FromPreHeader = false)
+{
+	BasicBlock *Header = L->getHeader();
+	BasicBlock *Latch = L->getLoopLatch();
+	BasicBlock *BodyEntry = getBodyEntry(*L);
+	Function *F = Header->getParent();
+
+	SmallVector<BasicBlock *, 8> Body;
+	for (BasicBlock *BB : L->blocks())
+	{
+		if (BB != Header)
+		{
+			Body.push_back(BB);
+		}
+	}
+
+	PeeledIterations Epi;
+	SmallVectorImpl<std::pair<PHINode *, Value *>> &PhiValues = Epi.PhiValues;
+	for (PHINode &Phi : Header->phis())
+	{
+		PhiValues.push_back({&Phi, FromPreHeader ? Phi.getIncomingValueForBlock(L->getLoopPreheader()) : &Phi});
+	}
+
+	for (unsigned i = 0; i < Count; i++)
+	{
+		ValueToValueMapTy VMap;
+		for (auto &[Phi, V] : PhiValues)
+		{
+			VMap[Phi] = V;
+		}
+
+		SmallVector<BasicBlock *, 8> Clones;
+		for (BasicBlock *BB : Body)
+		{
+			BasicBlock *Clone = CloneBasicBlock(BB, VMap, ".peel", F);
+			VMap[BB] = Clone;
+			Clones.push_back(Clone);
+		}
+		remapInstructionsInBlocks(Clones, VMap);
+
+		BasicBlock *EntryClone = cast<BasicBlock>(VMap[BodyEntry]);
+		if (Epi.Last)
+		{
+			Epi.Last->getTerminator()->replaceSuccessorWith(Header, EntryClone);
+		}
+		else
+		{
+			Epi.Entry = EntryClone;
+		}
+		Epi.Last = cast<BasicBlock>(VMap[Latch]);
+		Epi.Blocks.append(Clones.begin(), Clones.end());
+
+		/* The cloned latch branch is no latch anymore, its loop ID would end up in the merged one */
+		Epi.Last->getTerminator()->setMetadata(LLVMContext::MD_loop, nullptr);
+
+		for (auto &[Phi, V] : PhiValues)
+		{
+			Value *Next = Phi->getIncomingValueForBlock(Latch);
+			Value *Mapped = VMap.lookup(Next);
+			V = Mapped ? Mapped : Next;
+		}
+	}
+
+	/* Nothing may branch to the original header, the real successor is known only after fusion */
+	Epi.Last->getTerminator()->eraseFromParent();
+	new UnreachableInst(F->getContext(), Epi.Last);
+	return Epi;
+} /* cloneIterations */
+
+/* Make the fused loop run the common range and clone the rest of the longer loop. Must precede fuse() */
+bool
+preparePeeling(Loop *L1, Loop *L2, int64_t Difference, const DominatorTree &DT, PeeledIterations &Epi)
+{
+	if (Difference > 0)
+	{
+		/* The fused loop keeps Header1, so it has to exit with L2's condition */
+		BranchInst *Branch1 = cast<BranchInst>(L1->getHeader()->getTerminator());
+		BranchInst *Branch2 = cast<BranchInst>(L2->getHeader()->getTerminator());
+		ICmpInst *Cmp1 = cast<ICmpInst>(Branch1->getCondition());
+		ICmpInst *Cmp2 = cast<ICmpInst>(Branch2->getCondition());
+		Instruction *Bound2 = dyn_cast<Instruction>(Cmp2->getOperand(1));
+		if ((Branch1->getSuccessor(0) == getBodyEntry(*L1)) != (Branch2->getSuccessor(0) == getBodyEntry(*L2)))
+		{
+			return false;
+		}
+		if (Bound2 && !DT.dominates(Bound2, L1->getHeader()))
+		{
+			return false;
+		}
+
+		/* Other users of the compare keep its old meaning, only the exit branch gets the new bound */
+		if (!Cmp1->hasOneUse())
+		{
+			Cmp1 = cast<ICmpInst>(Cmp1->clone());
+			Cmp1->insertBefore(Branch1);
+			Branch1->setCondition(Cmp1);
+		}
+		Cmp1->setPredicate(Cmp2->getPredicate());
+		Cmp1->setOperand(1, Cmp2->getOperand(1));
+	}
+
+	Epi = cloneIterations(Difference > 0 ? L1 : L2, Difference > 0 ? Difference : -Difference);
+	return true;
+} /* preparePeeling */
+
+/* Link the epilogue into the exit edge of the fused loop L */
+void
+insertEpilogue(Loop *L, PeeledIterations &Epi, LoopInfo &LI, DomTreeUpdater &DTU)
+{
+	BasicBlock *Header = L->getHeader();
+	BasicBlock *Exit = L->getExitBlock();
+	SmallVector<DominatorTree::UpdateType, 16> TreeUpdates;
+
+	replaceSuccessor(Header, Exit, Epi.Entry, TreeUpdates);
+	Epi.Last->getTerminator()->eraseFromParent();
+	BranchInst::Create(Exit, Epi.Last);
+	Exit->replacePhiUsesWith(Header, Epi.Last);
+
+	for (BasicBlock *BB : Epi.Blocks)
+	{
+		BB->moveBefore(Exit);
+		for (BasicBlock *Succ : successors(BB))
+		{
+			TreeUpdates.push_back({DominatorTree::Insert, BB, Succ});
+		}
+		if (Loop *Parent = L->getParentLoop())
+		{
+			Parent->addBasicBlockToLoop(BB, LI);
+		}
+	}
+
+	DTU.applyUpdates(TreeUpdates);
+	DTU.flush();
+} /* insertEpilogue */
+
+/* Run the first Count iterations of L before it, the header phis of L start from the values they leave */
+void
+insertPrologue(Loop *L, unsigned Count, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE)
+{
+	BasicBlock *PreHeader = L->getLoopPreheader();
+	BasicBlock *Header = L->getHeader();
+	PeeledIterations Prologue = cloneIterations(L, Count, true);
+	SmallVector<DominatorTree::UpdateType, 16> TreeUpdates;
+
+	SE.forgetLoop(L);
+	replaceSuccessor(PreHeader, Header, Prologue.Entry, TreeUpdates);
+	Prologue.Last->getTerminator()->eraseFromParent();
+	BranchInst::Create(Header, Prologue.Last);
+	for (auto &[Phi, V] : Prologue.PhiValues)
+	{
+		Phi->setIncomingValueForBlock(PreHeader, V);
+	}
+	Header->replacePhiUsesWith(PreHeader, Prologue.Last);
+
+	for (BasicBlock *BB : Prologue.Blocks)
 	{
-		return false;
+		BB->moveBefore(Header);
+		for (BasicBlock *Succ : successors(BB))
+		{
+			TreeUpdates.push_back({DominatorTree::Insert, BB, Succ});
+		}
+		if (Loop *Parent = L->getParentLoop())
+		{
+			Parent->addBasicBlockToLoop(BB, LI);
+		}
 	}
-	
-	if (Exit1->size() > 1)
+
+	DTU.applyUpdates(TreeUpdates);
+	DTU.flush();
+} /* insertPrologue */
+
+/* After adjacency. L2 may take from L1 only values the fused header can chain */
+bool
+canFuseRotated(Loop *L1, Loop *L2, const DominatorTree &DT)
+{
+	BasicBlock *Header1 = L1->getHeader();
+	const BasicBlock *Latch1 = L1->getLoopLatch();
+	const BasicBlock *PreHeader1 = L1->getLoopPreheader();
+	const BasicBlock *PreHeader2 = L2->getLoopPreheader();
+
+	/* Other phis of L2 start either before L1 or from the value L1 leaves in one of its phis */
+	for (PHINode &Phi2 : L2->getHeader()->phis())
 	{
-		return false;
+		if (isIndex(Phi2))
+		{
+			continue;
+		}
+		const Value *Start = Phi2.getIncomingValueForBlock(PreHeader2);
+		const Instruction *Def = dyn_cast<Instruction>(Start);
+		if (!Def || DT.dominates(Def, PreHeader1->getTerminator()))
+		{
+			continue;
+		}
+		bool Chained = any_of(
+			Header1->phis(),
+			[&](PHINode &Phi1)
+			{
+				return Phi1.getIncomingValueForBlock(Latch1) == Start && canChainRecurrences(Phi1, L1, Phi2, L2);
+			}
+		);
+		if (Chained == false)
+		{
+			return false;
+		}
+	}
+
+	/* Any other use would see the current iteration of L1 instead of its last one */
+	for (const BasicBlock *BB : L1->blocks())
+	{
+		for (const Instruction &I : *BB)
+		{
+			for (const Use &U : I.uses())
+			{
+				const Instruction *User = cast<Instruction>(U.getUser());
+				if (!L2->contains(User))
+				{
+					continue;
+				}
+				const PHINode *Phi = dyn_cast<PHINode>(User);
+				if (Phi && Phi->getIncomingBlock(U) == PreHeader2)
+				{
+					continue;
+				}
+				return false;
+			}
+		}
 	}
 	return true;
-} /* areLoopsAdjacent */
+} /* canFuseRotated */
 
+/* Header-exiting loops. fuseUnrotated chains every L2 phi that starts from an L1 header phi */
 bool
-tryMoveInterferingCode(Loop *L1, Loop *L2, DependenceInfo &DI)
+canChainUnrotated(Loop *L1, Loop *L2)
 {
-	DenseMap<BasicBlock *, int> WaysToMove; /* 10 - up; 01 - down; 11 both; 00 - can't move */
-	BasicBlock *Exit1 = L1->getExitBlock();
-	BasicBlock *PreHeader2 = L2->getLoopPreheader();
-	BasicBlock *BB = Exit1->getSingleSuccessor();
+	for (PHINode &Phi2 : L2->getHeader()->phis())
+	{
+		if (isIndex(Phi2))
+		{
+			continue;
+		}
+		auto *Phi1 = dyn_cast<PHINode>(Phi2.getIncomingValueForBlock(L2->getLoopPreheader()));
+		if (Phi1 && Phi1->getParent() == L1->getHeader() && canChainRecurrences(*Phi1, L1, Phi2, L2) == false)
+		{
+			return false;
+		}
+	}
+	return true;
+} /* canChainUnrotated */
 
-	assert(Exit1 != PreHeader2 
-		&& Exit1->getSingleSuccessor() != PreHeader2 
-		&& "No complex interfering code here");
-	return false;
+/* Pair checks that do not modify IR. FB_None if the pair is legal. The verdict is cached until a fusion changes either
+   loop */
+FusionBlocker
+getLegalityBlocker(Loop *L1, Loop *L2, FusionCache &Cache, ScalarEvolution &SE, AAResults &AA, DependenceInfo &DI,
+	OptimizationRemarkEmitter &ORE)
+{
+	if (std::optional<FusionBlocker> Verdict = Cache.getPairVerdict(L1, L2))
+	{
+		return *Verdict;
+	}
+
+	const SCEV *TripCount1 = Cache.getFacts(L1).TripCount;
+	const SCEV *TripCount2 = Cache.getFacts(L2).TripCount;
+	std::optional<int64_t> Offset = getIndexOffset(L1, L2, SE);
+	FusionBlocker Blocker = FB_None;
+	if (L1->isRotatedForm() != L2->isRotatedForm())
+	{
+		Blocker = FB_MixedRotation;
+	}
+	else if (TripCount1->getSCEVType() == SCEVTypes::scCouldNotCompute ||
+		TripCount2->getSCEVType() == SCEVTypes::scCouldNotCompute)
+	{
+		Blocker = FB_UnknownTripCount;
+	}
+	else if (!Offset)
+	{
+		Blocker = FB_DifferentIndex;
+	}
+	/* Before the blockers shifting and versioning can lift, neither of them fixes a recurrence */
+	else if (!L1->isRotatedForm() && canChainUnrotated(L1, L2) == false)
+	{
+		Blocker = FB_Recurrence;
+	}
+	else if ((TripCount1 != TripCount2 || *Offset) && !getPeelableDifference(L1, L2, SE))
+	{
+		Blocker = FB_TripCountMismatch;
+	}
+	else if (loopsHaveInvalidDependencies(L1, L2, *Offset, Cache, SE, AA, DI, ORE))
+	{
+		Blocker = FB_Dependence;
+	}
+
+	Cache.setPairVerdict(L1, L2, Blocker);
+	return Blocker;
+} /* getLegalityBlocker */
 
-	while (BB != L2->getLoopPreheader())
+/* A pair illegal only because of backward dependences is fused with L2 lagging Shift iterations behind L1. The first
+   Shift iterations of L1 run in a prologue, the last Shift iterations of L2 in an epilogue */
+std::optional<unsigned>
+planShift(const Loop *L1, const Loop *L2, FusionCache &Cache, ScalarEvolution &SE, AAResults &AA, DependenceInfo &DI)
+{
+	if (L1->isRotatedForm() || L2->isRotatedForm() || haveSameIndex(L1, L2, SE) == false)
+	{
+		return std::nullopt;
+	}
+	const SCEV *TripCount = SE.getBackedgeTakenCount(L1);
+	if (isa<SCEVCouldNotCompute>(TripCount) || TripCount != SE.getBackedgeTakenCount(L2))
+	{
+		return std::nullopt;
+	}
+	if (canPeelPrologue(L1) == false || canPeelEpilogue(L2) == false)
 	{
-		WaysToMove.insert(std::make_pair(BB, 0b11));
+		return std::nullopt;
+	}
 
-		for (BasicBlock *L1BB : L1->blocks())
+	/* The index of L2 stays a phi of the fused header, so its start must be available there */
+	Value *Start2 = getIndex(*L2->getHeader())->getIncomingValueForBlock(L2->getLoopPreheader());
+	if (!isa<Constant>(Start2) && !isa<Argument>(Start2))
+	{
+		return std::nullopt;
+	}
+
+	std::optional<uint64_t> Shift = getRequiredShift(L1, L2, Cache, SE, AA, DI);
+	if (!Shift || *Shift == 0)
+	{
+		return std::nullopt;
+	}
+
+	/* Both loops must run at least Shift iterations */
+	if (!SE.isKnownPredicate(ICmpInst::ICMP_UGE, TripCount, SE.getConstant(TripCount->getType(), *Shift - 1)))
+	{
+		return std::nullopt;
+	}
+	return *Shift;
+} /* planShift */
+
+/* Addresses touched by an access over all iterations of L: [Low, High) */
+struct AccessRange
+{
+	const SCEV *Low;
+	const SCEV *High;
+};
+
+std::optional<AccessRange>
+getAccessRange(Instruction *I, const Loop *L, ScalarEvolution &SE)
+{
+	Value *Ptr = getLoadStorePointerOperand(I);
+	if (!Ptr)
+	{
+		return std::nullopt;
+	}
+
+	const SCEV *Low = SE.getSCEV(Ptr);
+	const SCEV *High = Low;
+	if (!SE.isLoopInvariant(Low, L))
+	{
+		const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(Low);
+		const SCEV *TripCount = SE.getBackedgeTakenCount(L);
+		if (!AR || AR->getLoop() != L || !AR->isAffine() || isa<SCEVCouldNotCompute>(TripCount))
 		{
-			for (Instruction &L1I : *L1BB)
+			return std::nullopt;
+		}
+		const SCEV *End = AR->evaluateAtIteration(TripCount, SE);
+		Low = SE.getUMinExpr(AR->getStart(), End);
+		High = SE.getUMaxExpr(AR->getStart(), End);
+	}
+
+	const DataLayout &DL = I->getModule()->getDataLayout();
+	Type *IndexTy = DL.getIndexType(Ptr->getType());
+	High = SE.getAddExpr(High, SE.getConstant(IndexTy, DL.getTypeStoreSize(getLoadStoreType(I)).getFixedValue()));
+	return AccessRange {Low, High};
+} /* getAccessRange */
+
+/* Runtime conditions under which the pair is legal to fuse */
+struct VersioningPlan
+{
+	SmallVector<std::pair<AccessRange, AccessRange>, 4> DisjointRanges;
+	const SCEV *TripCount1 = nullptr; /* Set when the trip counts must be compared */
+	const SCEV *TripCount2 = nullptr;
+};
+
+/* A pair can be versioned if every reason it is illegal can be checked at runtime */
+std::optional<VersioningPlan>
+planVersioning(const Loop *L1, const Loop *L2, FusionCache &Cache, ScalarEvolution &SE, AAResults &AA, DependenceInfo &DI)
+{
+	/* fuse() picks the rotated or unrotated shape from L1 alone */
+	if (L1->isRotatedForm() != L2->isRotatedForm())
+	{
+		return std::nullopt;
+	}
+
+	VersioningPlan Plan;
+	const SCEV *SymbolicTripCount1 = Cache.getFacts(L1).TripCount;
+	const SCEV *SymbolicTripCount2 = Cache.getFacts(L2).TripCount;
+	if (isa<SCEVCouldNotCompute>(SymbolicTripCount1) || isa<SCEVCouldNotCompute>(SymbolicTripCount2))
+	{
+		return std::nullopt;
+	}
+	if (haveSameIndex(L1, L2, SE) == false)
+	{
+		return std::nullopt;
+	}
+	if (SymbolicTripCount1 != SymbolicTripCount2)
+	{
+		Plan.TripCount1 = SE.getBackedgeTakenCount(L1);
+		Plan.TripCount2 = SE.getBackedgeTakenCount(L2);
+		if (isa<SCEVCouldNotCompute>(Plan.TripCount1) || isa<SCEVCouldNotCompute>(Plan.TripCount2)
+			|| Plan.TripCount1->getType() != Plan.TripCount2->getType())
+		{
+			return std::nullopt;
+		}
+	}
+
+	/* Only dependences between different objects disappear when their ranges don't overlap */
+	bool Unversionable = summariesHaveDependence(Cache.getFacts(L1).Accesses, Cache.getFacts(L2).Accesses, AA, DI, Cache.getPairDepQueries(),
+		[&](const Dependence &Dep)
+		{
+			if (!isInvalidDependence(Dep, L1, L2, SE))
+			{
+				return false;
+			}
+
+			Value *Ptr1 = getLoadStorePointerOperand(Dep.getSrc());
+			Value *Ptr2 = getLoadStorePointerOperand(Dep.getDst());
+			if (!Ptr1 || !Ptr2 || getUnderlyingObject(Ptr1) == getUnderlyingObject(Ptr2))
+			{
+				return true;
+			}
+
+			std::optional<AccessRange> Range1 = getAccessRange(Dep.getSrc(), L1, SE);
+			std::optional<AccessRange> Range2 = getAccessRange(Dep.getDst(), L2, SE);
+			if (!Range1 || !Range2)
+			{
+				return true;
+			}
+
+			for (const auto &[Checked1, Checked2] : Plan.DisjointRanges)
 			{
-				if (blockUsesValue(BB, &L1I))
+				if (Checked1.Low == Range1->Low && Checked1.High == Range1->High
+					&& Checked2.Low == Range2->Low && Checked2.High == Range2->High)
 				{
-					WaysToMove[BB] &= 0b01;
+					return false;
 				}
 			}
+			Plan.DisjointRanges.push_back({*Range1, *Range2});
+			return Plan.DisjointRanges.size() + (Plan.TripCount1 ? 1 : 0) > MaxFusionRuntimeChecks;
 		}
-		for (BasicBlock *L2BB : L2->blocks())
+	);
+	if (Unversionable)
+	{
+		return std::nullopt;
+	}
+	if (Plan.DisjointRanges.empty() && !Plan.TripCount1)
+	{
+		return std::nullopt;
+	}
+	return Plan;
+} /* planVersioning */
+
+/* Values defined in the versioned region and used after it get a phi in the common exit */
+void
+mergeVersionedLiveOuts(ArrayRef<BasicBlock *> Region, ArrayRef<BasicBlock *> Clones, BasicBlock *Exit, BasicBlock *Exiting,
+	ValueToValueMapTy &VMap, ScalarEvolution &SE)
+{
+	BasicBlock *ClonedExiting = cast<BasicBlock>(VMap[Exiting]);
+	for (PHINode &Phi : Exit->phis())
+	{
+		Value *V = Phi.getIncomingValueForBlock(Exiting);
+		Value *Mapped = VMap.lookup(V);
+		Phi.addIncoming(Mapped ? Mapped : V, ClonedExiting);
+	}
+
+	SmallPtrSet<const BasicBlock *, 32> Inside(Region.begin(), Region.end());
+	Inside.insert(Clones.begin(), Clones.end());
+	for (BasicBlock *BB : Region)
+	{
+		for (Instruction &I : *BB)
 		{
-			for (Instruction &I : *BB)
+			SmallVector<Use *, 4> OutsideUses;
+			for (Use &U : I.uses())
 			{
-				if (blockUsesValue(L2BB, &I))
+				const Instruction *User = cast<Instruction>(U.getUser());
+				if (Inside.contains(User->getParent()) || (isa<PHINode>(User) && User->getParent() == Exit))
 				{
-					WaysToMove[BB] &= 0b10;
+					continue;
 				}
+				OutsideUses.push_back(&U);
+			}
+			if (OutsideUses.empty())
+			{
+				continue;
+			}
+
+			SE.forgetValue(&I);
+			PHINode *Merge = PHINode::Create(I.getType(), 2, I.getName() + ".merge");
+			Merge->insertBefore(Exit->getFirstNonPHI());
+			Merge->addIncoming(&I, Exiting);
+			Merge->addIncoming(VMap[&I], ClonedExiting);
+			for (Use *U : OutsideUses)
+			{
+				U->set(Merge);
 			}
 		}
-		if (WaysToMove.at(BB) == 0b00)
+	}
+} /* mergeVersionedLiveOuts */
+
+/* Clone L1, PreHeader2 and L2 as a fallback taken when the runtime checks fail. The originals become the fast path */
+bool
+versionLoops(Loop *L1, Loop *L2, const VersioningPlan &Plan, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE)
+{
+	BasicBlock *PreHeader1 = L1->getLoopPreheader();
+	BasicBlock *Exit2 = L2->getExitBlock();
+	Function *F = PreHeader1->getParent();
+	const DataLayout &DL = F->getParent()->getDataLayout();
+
+	SCEVExpander Expander(SE, DL, "fusion.check");
+	SmallVector<const SCEV *, 16> Expressions;
+	for (const auto &[Range1, Range2] : Plan.DisjointRanges)
+	{
+		Expressions.append({Range1.Low, Range1.High, Range2.Low, Range2.High});
+	}
+	if (Plan.TripCount1)
+	{
+		Expressions.append({Plan.TripCount1, Plan.TripCount2});
+	}
+	for (const SCEV *S : Expressions)
+	{
+		if (!Expander.isSafeToExpandAt(S, PreHeader1->getTerminator()))
 		{
 			return false;
 		}
-		BB = BB->getSingleSuccessor();
 	}
 
-	BasicBlock *PreHeader1 = L1->getLoopPreheader();
-	for (auto &pair : WaysToMove)
+	/* The manual DT updates below need no pending lazy updates */
+	DTU.flush();
+	DominatorTree &DT = DTU.getDomTree();
+
+	/* PreHeader1 becomes the check block */
+	BasicBlock *NewPreHeader1 = SplitBlock(PreHeader1, PreHeader1->getTerminator(), &DT, &LI, nullptr, "fusion.ph");
+
+	ValueToValueMapTy VMap;
+	SmallVector<BasicBlock *, 32> Clones;
+	cloneLoopWithPreheader(Exit2, PreHeader1, L1, VMap, ".fallback", &LI, &DT, Clones);
+	/* The exiting block dominates the exit, the header does not when L1 is rotated */
+	cloneLoopWithPreheader(Exit2, cast<BasicBlock>(VMap[L1->getExitingBlock()]), L2, VMap, ".fallback", &LI, &DT, Clones);
+	remapInstructionsInBlocks(Clones, VMap);
+
+	SmallVector<BasicBlock *, 32> Region {NewPreHeader1};
+	Region.append(L1->block_begin(), L1->block_end());
+	Region.push_back(L2->getLoopPreheader());
+	Region.append(L2->block_begin(), L2->block_end());
+	mergeVersionedLiveOuts(Region, Clones, Exit2, L2->getExitingBlock(), VMap, SE);
+	DT.changeImmediateDominator(Exit2, PreHeader1);
+
+	/* Any overlap or trip count mismatch takes the fallback */
+	IRBuilder<> Builder(PreHeader1->getTerminator());
+	Value *Conflict = Builder.getFalse();
+	for (const auto &[Range1, Range2] : Plan.DisjointRanges)
+	{
+		Value *Low1 = Expander.expandCodeFor(Range1.Low, Range1.Low->getType(), PreHeader1->getTerminator());
+		Value *High1 = Expander.expandCodeFor(Range1.High, Range1.High->getType(), PreHeader1->getTerminator());
+		Value *Low2 = Expander.expandCodeFor(Range2.Low, Range2.Low->getType(), PreHeader1->getTerminator());
+		Value *High2 = Expander.expandCodeFor(Range2.High, Range2.High->getType(), PreHeader1->getTerminator());
+		Value *Overlap = Builder.CreateAnd(Builder.CreateICmpULT(Low1, High2), Builder.CreateICmpULT(Low2, High1), "fusion.overlap");
+		Conflict = Builder.CreateOr(Conflict, Overlap, "fusion.conflict");
+	}
+	if (Plan.TripCount1)
+	{
+		Value *TripCount1 = Expander.expandCodeFor(Plan.TripCount1, Plan.TripCount1->getType(), PreHeader1->getTerminator());
+		Value *TripCount2 = Expander.expandCodeFor(Plan.TripCount2, Plan.TripCount2->getType(), PreHeader1->getTerminator());
+		Conflict = Builder.CreateOr(Conflict, Builder.CreateICmpNE(TripCount1, TripCount2), "fusion.conflict");
+	}
+
+	BasicBlock *FallbackPreHeader = cast<BasicBlock>(VMap[NewPreHeader1]);
+	PreHeader1->getTerminator()->eraseFromParent();
+	BranchInst::Create(FallbackPreHeader, NewPreHeader1, Conflict, PreHeader1);
+
+	/* Both loops run under the checks now, facts derived from the conditions that reach them may change */
+	SE.forgetLoop(L1);
+	SE.forgetLoop(L2);
+	SE.forgetBlockAndLoopDispositions();
+
+	/* The region was cloned wholesale, recomputing is simpler than listing every new edge */
+	DTU.getPostDomTree().recalculate(*F);
+	return true;
+} /* versionLoops */
+
+uint64_t
+getAccessedBytes(ArrayRef<Instruction *> Accesses, const DataLayout &DL)
+{
+	uint64_t Bytes = 0;
+	for (Instruction *I : Accesses)
 	{
-		BasicBlock *BBToMove = pair.first;
-		if (pair.second & 0b10)
+		if (isa<LoadInst>(I) || isa<StoreInst>(I))
 		{
-			while (pred_begin(BBToMove) != pred_end(BBToMove))
-			{
-				(*(pred_begin(BBToMove)))->getTerminator()->replaceSuccessorWith(BBToMove, BBToMove->getSingleSuccessor());
-			}
-			while (pred_begin(PreHeader1) != pred_end(PreHeader1))
+			Bytes += DL.getTypeStoreSize(getLoadStoreType(I)).getKnownMinValue();
+		}
+	}
+	return Bytes;
+} /* getAccessedBytes */
+
+/* Memory of L passes LoopAccessAnalysis and every header phi is an induction or a reduction */
+bool
+isVectorizable(Loop *L, FusionCache &Cache, ScalarEvolution &SE)
+{
+	if (Cache.getAccessInfo(L).canVectorizeMemory() == false)
+	{
+		return false;
+	}
+	for (PHINode &Phi : L->getHeader()->phis())
+	{
+		InductionDescriptor Induction;
+		RecurrenceDescriptor Reduction;
+		if (!InductionDescriptor::isInductionPHI(&Phi, L, &SE, Induction)
+			&& !RecurrenceDescriptor::isReductionPHI(&Phi, L, Reduction))
+		{
+			return false;
+		}
+	}
+	return true;
+} /* isVectorizable */
+
+/* Overlap checks the vectorizer would add for objects one loop accesses and the other loop writes */
+unsigned
+countCrossRuntimeChecks(const AccessSummary &Summary1, const AccessSummary &Summary2, AAResults &AA)
+{
+	unsigned Checks = 0;
+	for (const auto &[Object1, Accesses1] : Summary1)
+	{
+		bool Writes1 = any_of(Accesses1, [](const Instruction *I) { return I->mayWriteToMemory(); });
+		for (const auto &[Object2, Accesses2] : Summary2)
+		{
+			bool Writes2 = any_of(Accesses2, [](const Instruction *I) { return I->mayWriteToMemory(); });
+			if (Object1 != Object2 && (Writes1 || Writes2) && objectsMayAlias(Object1, Object2, AA))
 			{
-				(*(pred_begin(PreHeader1)))->getTerminator()->replaceSuccessorWith(PreHeader1, BBToMove);
+				Checks++;
 			}
-			BBToMove->getTerminator()->replaceSuccessorWith(BBToMove->getSingleSuccessor(), PreHeader1);
 		}
 	}
-	return true;
-} /* tryMoveInterferingCode */
+	return Checks;
+} /* countCrossRuntimeChecks */
+
+/* The fused loop does not exist yet, so its vectorizability is forecast from the input loops. Dependences between
+   the bodies that made the pair legal keep their order in a vector iteration, what can break is the number of
+   runtime checks */
+struct VectorizationForecast
+{
+	bool Loop1;
+	bool Loop2;
+	bool Fused;
+};
+
+/* std::nullopt unless both loops are innermost and rotated, the only loops the vectorizer takes */
+std::optional<VectorizationForecast>
+forecastVectorization(Loop *L1, Loop *L2, FusionCache &Cache, ScalarEvolution &SE, AAResults &AA)
+{
+	if (!L1->isInnermost() || !L2->isInnermost() || !L1->isRotatedForm() || !L2->isRotatedForm())
+	{
+		return std::nullopt;
+	}
+
+	VectorizationForecast Forecast;
+	Forecast.Loop1 = isVectorizable(L1, Cache, SE);
+	Forecast.Loop2 = isVectorizable(L2, Cache, SE);
+	Forecast.Fused = Forecast.Loop1 && Forecast.Loop2;
+	if (Forecast.Fused)
+	{
+		unsigned Checks = Cache.getAccessInfo(L1).getNumRuntimePointerChecks()
+			+ Cache.getAccessInfo(L2).getNumRuntimePointerChecks()
+			+ countCrossRuntimeChecks(Cache.getFacts(L1).Accesses, Cache.getFacts(L2).Accesses, AA);
+		Forecast.Fused = Checks <= VectorizerParams::RuntimeMemoryCheckThreshold;
+	}
+
+	if (DebugMode)
+	{
+		errs()	<< "\tvectorizable " << L1->getHeader()->getName() << " + " << L2->getHeader()->getName()
+			<< ": " << Forecast.Loop1 << " + " << Forecast.Loop2 << " -> " << Forecast.Fused << "\n";
+	}
+	return Forecast;
+} /* forecastVectorization */
 
 bool
-tryCleanPreHeader(Loop *L1, Loop *L2, DependenceInfo &DI)
+losesVectorization(const std::optional<VectorizationForecast> &Forecast)
 {
-	DenseMap<Instruction *, int> WaysToMove; /* 10 - up; 01 - down; 11 both; 00 - can't move */
+	return Forecast && (Forecast->Loop1 || Forecast->Loop2) && !Forecast->Fused;
+} /* losesVectorization */
 
-	BasicBlock *Exit1 = L1->getExitBlock();
-	BasicBlock *PreHeader2 = L2->getLoopPreheader();
-	if (Exit1 != PreHeader2) assert(Exit1->size() == 1 && Exit1->getSingleSuccessor() == PreHeader2);
+/* All terms are in memory accesses per iteration of the fused loop */
+struct FusionProfit
+{
+	int Reuse;     /* accesses of L2 to objects L1 already touched */
+	int Spills;    /* extra spill code when combined pressure exceeds a register class */
+	int Footprint; /* accesses that stop hitting in L1D because only the separate loops fit there */
+	int Vectorization; /* accesses of the fused loop when it is forecast to vectorize and -fusion-vectorization=prefer */
+	int Score;
+};
+
+FusionProfit
+estimateFusionProfit(const Loop *L1, const Loop *L2, FusionCache &Cache, const TargetTransformInfo &TTI,
+	const std::optional<VectorizationForecast> &Forecast)
+{
+	const LoopFacts &Facts1 = Cache.getFacts(L1);
+	const LoopFacts &Facts2 = Cache.getFacts(L2);
+	const DataLayout &DL = L1->getHeader()->getModule()->getDataLayout();
+
+	FusionProfit Profit = {0, 0, 0, 0, 0};
 
-	int m = 0b11;
-	for (BasicBlock *BB1 : L1->blocks())
+	uint64_t Bytes1 = 0, Bytes2 = 0, SharedBytes = 0;
+	int Accesses = 0;
+	for (const auto &[Object, Accesses1] : Facts1.Accesses)
 	{
-		if (blocksHaveFlowDependencies(*BB1, *PreHeader2, DI))
+		Bytes1 += getAccessedBytes(Accesses1, DL);
+		Accesses += Accesses1.size();
+	}
+	for (const auto &[Object, Accesses2] : Facts2.Accesses)
+	{
+		uint64_t ObjectBytes = getAccessedBytes(Accesses2, DL);
+		Bytes2 += ObjectBytes;
+		Accesses += Accesses2.size();
+
+		auto it = Facts1.Accesses.find(Object);
+		if (Object && it != Facts1.Accesses.end())
 		{
-			m &= 0b01;
+			Profit.Reuse += Accesses2.size();
+			SharedBytes += std::min(ObjectBytes, getAccessedBytes(it->second, DL));
 		}
 	}
-	for (BasicBlock *BB2 : L2->blocks())
+
+	for (const auto &[ClassID, Pressure1] : Facts1.Pressure)
 	{
-		if (blocksHaveFlowDependencies(*PreHeader2, *BB2, DI))
+		unsigned Pressure2 = Facts2.Pressure.lookup(ClassID);
+		unsigned Available = std::max({TTI.getNumberOfRegisters(ClassID), Pressure1, Pressure2});
+		if (Pressure1 + Pressure2 > Available)
 		{
-			m &= 0b10;
+			/* Every spilled value costs a store and a reload */
+			Profit.Spills += 2 * (Pressure1 + Pressure2 - Available);
 		}
 	}
-	if (m == 0) {errs() << "flow\n"; return false;}
 
-	for (Instruction &I : *PreHeader2)
+	const auto *TripCount = dyn_cast<SCEVConstant>(Facts1.TripCount);
+	std::optional<unsigned> CacheSize = TTI.getCacheSize(TargetTransformInfo::CacheLevel::L1D);
+	if (TripCount && CacheSize)
+	{
+		uint64_t Iterations = TripCount->getAPInt().getLimitedValue(UINT32_MAX) + 1;
+		uint64_t FusedBytes = (Bytes1 + Bytes2 - SharedBytes) * Iterations;
+		if (Bytes1 * Iterations <= *CacheSize && Bytes2 * Iterations <= *CacheSize && FusedBytes > *CacheSize)
+		{
+			Profit.Footprint = Accesses;
+		}
+	}
+
+	if (FusionVectorization == VP_Prefer && Forecast && Forecast->Fused)
+	{
+		Profit.Vectorization = Accesses;
+	}
+
+	Profit.Score = Profit.Reuse - Profit.Spills - Profit.Footprint + Profit.Vectorization;
+	return Profit;
+} /* estimateFusionProfit */
+
+bool
+isProfitablePair(const Loop *L1, const Loop *L2, FusionCache &Cache, const TargetTransformInfo &TTI,
+	const std::optional<VectorizationForecast> &Forecast)
+{
+	FusionProfit Profit = estimateFusionProfit(L1, L2, Cache, TTI, Forecast);
+	if (PrintFusionCost)
+	{
+		errs()	<< "\tcost " << L1->getHeader()->getName() << " + " << L2->getHeader()->getName()
+			<< ": reuse " << Profit.Reuse
+			<< ", spills " << Profit.Spills
+			<< ", footprint " << Profit.Footprint
+			<< ", vectorization " << Profit.Vectorization
+			<< ", score " << Profit.Score << "\n";
+	}
+	return Profit.Score >= FusionThreshold;
+} /* isProfitablePair */
+
+bool
+isAddressComputation(const Instruction &I)
+{
+	return isa<GetElementPtrInst>(I) || isa<CastInst>(I);
+} /* isAddressComputation */
+
+/* Both bodies compute the same addresses from the shared index. An identical dominating computation is reused */
+bool
+eliminateRedundantAddresses(Loop *L, LoopInfo &LI, const DominatorTree &DT)
+{
+	bool Changed = false;
+	DenseMap<std::pair<unsigned, Value *>, SmallVector<Instruction *, 2>> Seen;
+	LoopBlocksRPO RPOT(L);
+	RPOT.perform(&LI);
+	for (BasicBlock *BB : RPOT)
+	{
+		for (Instruction &I : make_early_inc_range(*BB))
+		{
+			if (isAddressComputation(I) == false)
+			{
+				continue;
+			}
+
+			SmallVectorImpl<Instruction *> &Candidates = Seen[{I.getOpcode(), I.getOperand(0)}];
+			auto Leader = find_if(
+				Candidates,
+				[&](const Instruction *J)
+				{
+					return J->isIdenticalTo(&I) && DT.dominates(J, &I);
+				}
+			);
+			if (Leader == Candidates.end())
+			{
+				Candidates.push_back(&I);
+				continue;
+			}
+			I.replaceAllUsesWith(*Leader);
+			I.eraseFromParent();
+			NumAddressesEliminated++;
+			Changed = true;
+		}
+	}
+	return Changed;
+} /* eliminateRedundantAddresses */
+
+/* A load takes the value of the store that clobbers it at the same address, or of an earlier load with the same
+   clobber. Runs after eliminateRedundantAddresses, so equal addresses are the same value */
+bool
+eliminateRedundantLoads(Loop *L, LoopInfo &LI, const DominatorTree &DT, MemorySSA &MSSA)
+{
+	bool Changed = false;
+	MemorySSAUpdater Updater(&MSSA);
+	MemorySSAWalker *Walker = MSSA.getWalker();
+	DenseMap<std::pair<Value *, Type *>, SmallVector<LoadInst *, 2>> Available;
+	LoopBlocksRPO RPOT(L);
+	RPOT.perform(&LI);
+	for (BasicBlock *BB : RPOT)
 	{
-		if (&I == PreHeader2->getTerminator())
-		{
-			break;
-		}
-		WaysToMove.insert(std::make_pair(&I, 0b11));
-		for (BasicBlock *L1BB : L1->blocks())
+		for (Instruction &I : make_early_inc_range(*BB))
 		{
-			for (Value *V : I.operands())
+			LoadInst *Load = dyn_cast<LoadInst>(&I);
+			if (!Load || !Load->isSimple())
 			{
-				if (blockProducesValue(L1BB, V))
+				continue;
+			}
+
+			MemoryAccess *Clobber = Walker->getClobberingMemoryAccess(MSSA.getMemoryAccess(Load));
+			Value *Replacement = nullptr;
+			if (const auto *Def = dyn_cast<MemoryDef>(Clobber))
+			{
+				StoreInst *Store = dyn_cast_or_null<StoreInst>(Def->getMemoryInst());
+				if (Store && Store->isSimple() && L->contains(Store)
+					&& Store->getPointerOperand() == Load->getPointerOperand()
+					&& Store->getValueOperand()->getType() == Load->getType())
 				{
-					WaysToMove[&I] &= 0b01;
+					Replacement = Store->getValueOperand();
 				}
 			}
-		}
 
-		for (BasicBlock *L2BB : L2->blocks())
-		{
-			if (blockUsesValue(L2BB, &I))
+			SmallVectorImpl<LoadInst *> &Loads = Available[{Load->getPointerOperand(), Load->getType()}];
+			for (LoadInst *Prev : Loads)
 			{
-				WaysToMove[&I] &= 0b10;
+				if (Replacement)
+				{
+					break;
+				}
+				if (DT.dominates(Prev, Load) && Walker->getClobberingMemoryAccess(MSSA.getMemoryAccess(Prev)) == Clobber)
+				{
+					Replacement = Prev;
+				}
+			}
+			if (!Replacement)
+			{
+				Loads.push_back(Load);
+				continue;
 			}
+
+			Load->replaceAllUsesWith(Replacement);
+			Updater.removeMemoryAccess(Load);
+			Load->eraseFromParent();
+			NumLoadsEliminated++;
+			Changed = true;
 		}
-		if (WaysToMove.at(&I) == 0b00)
+	}
+	return Changed;
+} /* eliminateRedundantLoads */
+
+/* Cleanup limited to the fused loop, instead of running GVN over the whole function */
+bool
+cleanUpFusedBody(Loop *L, LoopInfo &LI, DominatorTree &DT, FusionCache &Cache, AAResults &AA)
+{
+	bool Changed = eliminateRedundantAddresses(L, LI, DT);
+	MemorySSA &MSSA = Cache.getMemorySSA(*L->getHeader()->getParent(), AA, DT);
+	Changed |= eliminateRedundantLoads(L, LI, DT, MSSA);
+	return Changed;
+} /* cleanUpFusedBody */
+
+/* A local array used only in L, where every iteration stores an element before reloading it. Each element then lives
+   through one iteration, so the loads take the stored values and the array is deleted */
+bool
+contractArray(AllocaInst *Alloca, const Loop *L, const DominatorTree &DT, ScalarEvolution &SE)
+{
+	SmallVector<Instruction *, 8> Pointers {Alloca};
+	SmallVector<Instruction *, 8> Accesses;
+	SmallVector<Instruction *, 4> Markers;
+	for (unsigned i = 0; i < Pointers.size(); i++)
+	{
+		for (User *U : Pointers[i]->users())
 		{
+			Instruction *I = cast<Instruction>(U);
+			if (isa<GetElementPtrInst>(I))
+			{
+				Pointers.push_back(I);
+				continue;
+			}
+			if (I->isLifetimeStartOrEnd())
+			{
+				Markers.push_back(I);
+				continue;
+			}
+			if (!L->contains(I))
+			{
+				return false;
+			}
+			if (auto *Load = dyn_cast<LoadInst>(I); Load && Load->isSimple())
+			{
+				Accesses.push_back(I);
+				continue;
+			}
+			if (auto *Store = dyn_cast<StoreInst>(I); Store && Store->isSimple() && Store->getPointerOperand() == Pointers[i])
+			{
+				Accesses.push_back(I);
+				continue;
+			}
 			return false;
 		}
 	}
-
-	BasicBlock *PreHeader1 = L1->getLoopPreheader();
-	Instruction *PreHeader1Term = PreHeader1->getTerminator();
-	int move = 0b11;
-	for (auto &pair : WaysToMove)
+	if (Accesses.empty())
 	{
-		move &= pair.second;
+		return false;
 	}
 
-	/* Move entire set of instructions up or down */
-	if (move & 0b10)
+	/* All accesses touch the same element in an iteration and different elements in different iterations */
+	const SCEV *Address = SE.getSCEV(getLoadStorePointerOperand(Accesses.front()));
+	Type *AccessTy = getLoadStoreType(Accesses.front());
+	for (Instruction *I : Accesses)
 	{
-		while (&*(PreHeader2->begin()) != PreHeader2->getTerminator())
+		if (SE.getSCEV(getLoadStorePointerOperand(I)) != Address || getLoadStoreType(I) != AccessTy)
 		{
-			(&*(PreHeader2->begin()))->moveBefore(PreHeader1Term);
+			return false;
 		}
 	}
-	else if (move & 0b01)
+	const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(Address);
+	if (!AR || AR->getLoop() != L || !AR->isAffine())
 	{
-		Instruction *Exit2Start = &*(L2->getExitBlock()->begin());
-		while (&*(PreHeader2->begin()) != PreHeader2->getTerminator())
-		{
-			(&*(PreHeader2->begin()))->moveBefore(Exit2Start);
-		}
+		return false;
 	}
-	else
+	const SCEVConstant *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+	const DataLayout &DL = Alloca->getModule()->getDataLayout();
+	if (!Step || Step->getAPInt().abs().ult(DL.getTypeStoreSize(AccessTy).getFixedValue()))
 	{
 		return false;
 	}
-	assert(PreHeader2->size() == 1 && "Incorrect PreHeader cleaning");
-	return true;
-} /* tryCleanPreHeader */
 
-bool
-tryCleanExit(Loop *L1, Loop *L2)
-{
-	BasicBlock *Exit1 = L1->getExitBlock();
-	BasicBlock *PreHeader2 = L2->getLoopPreheader();
-	if (Exit1 == PreHeader2)
+	/* Nothing is read before the iteration wrote it */
+	for (Instruction *I : Accesses)
 	{
-		return true;
+		bool Written = !isa<LoadInst>(I) || any_of(
+			Accesses,
+			[&](const Instruction *J)
+			{
+				return isa<StoreInst>(J) && DT.dominates(J, I);
+			}
+		);
+		if (Written == false)
+		{
+			return false;
+		}
 	}
 
-	assert(Exit1->getSingleSuccessor() == PreHeader2);
+	SmallVector<PHINode *, 8> NewPhis;
+	SSAUpdater Updater(&NewPhis);
+	LoadAndStorePromoter Promoter(Accesses, Updater, Alloca->getName());
+	Promoter.run(Accesses);
 
-	while (&*(Exit1->begin()) != Exit1->getTerminator())
+	for (Instruction *I : Markers)
 	{
-		(&*(Exit1->begin()))->moveBefore(&*(PreHeader2->begin()));
+		I->eraseFromParent();
 	}
-	/* For now always returns true */
+	for (Instruction *I : reverse(Pointers))
+	{
+		I->eraseFromParent();
+	}
+	NumArraysContracted++;
 	return true;
-} /* tryCleanExit */
-
-bool
-tryCleanExitAndPreHeader(Loop *L1, Loop *L2, DependenceInfo &DI)
-{
-	return tryCleanExit(L1, L2) && tryCleanPreHeader(L1, L2, DI);
-} /* tryCleanExitAndPreHeader */
+} /* contractArray */
 
 bool
-tryMakeLoopsAdjacent(Loop *L1, Loop *L2, DependenceInfo &DI)
+contractArrays(Loop *L, const DominatorTree &DT, ScalarEvolution &SE)
 {
-	if (areLoopsAdjacent(L1, L2))
+	SmallSetVector<AllocaInst *, 4> Allocas;
+	for (BasicBlock *BB : L->blocks())
 	{
-		return true;
-	}
-
-	BasicBlock *Exit1 = L1->getExitBlock();
-	BasicBlock *PreHeader2 = L2->getLoopPreheader();
-
-	/* Check if loops have more than 2 control-flow equivalent Basic Blocks between them */
-	if (Exit1 != PreHeader2 && Exit1->getSingleSuccessor() != PreHeader2)
-	{
-		if (tryMoveInterferingCode(L1, L2, DI) == false)
+		for (Instruction &I : *BB)
 		{
-			return false;
+			if (Value *Ptr = getLoadStorePointerOperand(&I))
+			{
+				if (auto *Alloca = dyn_cast<AllocaInst>(getUnderlyingObject(Ptr)))
+				{
+					Allocas.insert(Alloca);
+				}
+			}
 		}
 	}
 
-	/* Remove important instructions from BB between loops if possible */
-	if (Exit1->size() > 1 || PreHeader2->size() > 1)
+	bool Changed = false;
+	for (AllocaInst *Alloca : Allocas)
 	{
-		if (tryCleanExitAndPreHeader(L1, L2, DI) == false)
-		{
-			//errs() << "can not clean pre header\n";
-			return false;
-		}
+		Changed |= contractArray(Alloca, L, DT, SE);
 	}
-
-	/* Combine Exit and PreHeader into one BB */
-	if (Exit1->getSingleSuccessor() == PreHeader2)
+	if (Changed)
 	{
-		while (pred_begin(Exit1) != pred_end(Exit1))
-		{
-			(*(pred_begin(Exit1)))->getTerminator()->replaceSuccessorWith(Exit1, PreHeader2);
-		}
-		Exit1->eraseFromParent();
+		SE.forgetLoop(L);
 	}
+	return Changed;
+} /* contractArrays */
 
-	/* Final check before return */
-	if (L1->getExitBlock() == L2->getLoopPreheader() && L2->getLoopPreheader()->size() == 1)
+bool
+processLoops(const SmallVector<Loop *> &Loops, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE, FusionCache &Cache, AAResults &AA, DependenceInfo &DI, const TargetTransformInfo &TTI,
+	OptimizationRemarkEmitter &ORE);
+
+/* Inner loops of a freshly fused loop are siblings now. Fusing them right away turns a pair of nests into one nest */
+bool
+fuseInnerLoops(Loop *L, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE, FusionCache &Cache, AAResults &AA, DependenceInfo &DI, const TargetTransformInfo &TTI,
+	OptimizationRemarkEmitter &ORE)
+{
+	if (L->getSubLoops().size() < 2)
 	{
-		return true;
+		return false;
 	}
-
-	//errs() << "can not make adj\n";
-	return false;
-} /* tryMakeLoopsAdjacent */
+	SmallVector<Loop *> SubLoops(L->begin(), L->end());
+	return processLoops(SubLoops, LI, DTU, SE, Cache, AA, DI, TTI, ORE);
+} /* fuseInnerLoops */
 
 bool
-processSet(std::list<Loop *> &set, ScalarEvolution &SE, DependenceInfo &DI)
+processSet(CFESet &set, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE, FusionCache &Cache, AAResults &AA, DependenceInfo &DI, const TargetTransformInfo &TTI,
+	OptimizationRemarkEmitter &ORE)
 {
-	for (auto it1 = set.begin(), it1e = set.end(); it1 != it1e; ++it1)
+	bool fused = false;
+	for (auto it1 = set.begin(); it1 != set.end(); )
 	{
+		/* L1 stays the same object after each fusion and keeps absorbing later members */
 		Loop *L1 = *it1;
-		for (auto it2 = std::next(it1), it2e = set.end(); it2 != it2e; ++it2)
+		bool Versioned = false;
+		for (auto it2 = std::next(it1); it2 != set.end(); )
 		{
 			Loop *L2 = *it2;
-			const SCEV *TripCount1 = SE.getSymbolicMaxBackedgeTakenCount(L1);
-			const SCEV *TripCount2 = SE.getSymbolicMaxBackedgeTakenCount(L2);
-			if (TripCount1->getSCEVType() == SCEVTypes::scCouldNotCompute ||
-				TripCount2->getSCEVType() == SCEVTypes::scCouldNotCompute)
+			if (Cache.isFusionBudgetExhausted())
+			{
+				reportFusionBudget(L1, Cache, ORE);
+				return fused;
+			}
+			if (Cache.markCounted(L1, L2))
+			{
+				NumPairsTried++;
+			}
+			Cache.startPair();
+
+			std::optional<unsigned> Shift;
+			std::optional<VersioningPlan> Plan;
+			FusionBlocker Blocker;
+			{
+				PhaseScope Phase("dependences", "Dependence checks");
+				Blocker = getLegalityBlocker(L1, L2, Cache, SE, AA, DI, ORE);
+				if (Blocker == FB_Dependence && MaxFusionShift > 0)
+				{
+					Shift = planShift(L1, L2, Cache, SE, AA, DI);
+				}
+				/* Only these blockers can be turned into runtime checks */
+				if ((Blocker == FB_Dependence || Blocker == FB_TripCountMismatch) && !Shift && EnableFusionVersioning)
+				{
+					Plan = planVersioning(L1, L2, Cache, SE, AA, DI);
+				}
+			}
+			if (Blocker != FB_None && !Shift && !Plan)
+			{
+				reportMissed(L1, L2, Blocker, Cache, ORE);
+				++it2;
+				continue;
+			}
+			std::optional<VectorizationForecast> Forecast;
+			if (FusionVectorization != VP_Ignore)
+			{
+				Forecast = forecastVectorization(L1, L2, Cache, SE, AA);
+			}
+			if (losesVectorization(Forecast))
 			{
+				if (DebugMode)
+				{
+					errs() << "\trefused, the fused loop would not vectorize\n";
+				}
+				reportMissed(L1, L2, FB_LosesVectorization, Cache, ORE);
+				++it2;
 				continue;
 			}
-			if (TripCount1 != TripCount2)
+			if (isProfitablePair(L1, L2, Cache, TTI, Forecast) == false)
 			{
+				reportMissed(L1, L2, FB_Unprofitable, Cache, ORE);
+				++it2;
 				continue;
 			}
-			if (loopsHaveInvalidDependencies(L1, L2, DI))
+
+			/* Checks that do not need adjacency come first, making loops adjacent moves code and deletes blocks */
+			int64_t Prologue = 0;
+			std::optional<int64_t> Difference;
+			if (!Shift && !Plan)
+			{
+				Prologue = getIndexOffset(L1, L2, SE).value_or(0);
+			}
+			if (!Shift && !Plan && (Prologue || Cache.getFacts(L1).TripCount != Cache.getFacts(L2).TripCount))
+			{
+				Difference = getPeelableDifference(L1, L2, SE);
+				if (!Difference)
+				{
+					reportMissed(L1, L2, FB_PeelingFailed, Cache, ORE);
+					++it2;
+					continue;
+				}
+			}
+			if (tryMakeLoopsAdjacent(L1, L2, LI, DTU, Cache, AA, ORE) == false)
 			{
+				++it2;
 				continue;
 			}
-			if (tryMakeLoopsAdjacent(L1, L2, DI) == false)
+			if (L1->isRotatedForm() && canFuseRotated(L1, L2, DTU.getDomTree()) == false)
 			{
+				reportMissed(L1, L2, FB_RotatedShape, Cache, ORE);
+				++it2;
 				continue;
 			}
 
-			/* Finally, fuse loops */
-			fuse(L1, L2);
-			return true;
+			/* The original loops are the fast path, the checks cover what made the pair illegal */
+			if (Plan && versionLoops(L1, L2, *Plan, LI, DTU, SE) == false)
+			{
+				reportMissed(L1, L2, FB_VersioningFailed, Cache, ORE);
+				++it2;
+				continue;
+			}
+
+			/* Different ranges: L1 runs up to the start of L2 in a prologue, the fused loop runs the common range and the
+			   rest of the longer loop is peeled */
+			PeeledIterations Epi;
+			if (Shift)
+			{
+				/* L2 lags behind: L1 starts Shift iterations early and L2 finishes Shift iterations late */
+				preparePeeling(L1, L2, -int64_t(*Shift), DTU.getDomTree(), Epi);
+				insertPrologue(L1, *Shift, LI, DTU, SE);
+			}
+			else if (Difference)
+			{
+				if (*Difference && preparePeeling(L1, L2, *Difference, DTU.getDomTree(), Epi) == false)
+				{
+					reportMissed(L1, L2, FB_PeelingFailed, Cache, ORE);
+					++it2;
+					continue;
+				}
+				if (Prologue)
+				{
+					insertPrologue(L1, Prologue, LI, DTU, SE);
+				}
+			}
+
+			/* Either latch may survive fusion, so both lose their loop ID and the fused loop gets the merged one */
+			MDNode *LoopID = mergeLoopIDs(L1, L2, !Shift && bodiesStayParallel(L1, L2, Cache, SE, AA, DI));
+			L1->setLoopID(nullptr);
+			L2->setLoopID(nullptr);
+
+			/* L2 is gone after fuse(), so the remark is emitted first */
+			ORE.emit([&]()
+			{
+				OptimizationRemark Remark(DEBUG_TYPE, "Fused", L1->getStartLoc(), L1->getHeader());
+				Remark	<< "loop " << ore::NV("Loop", L2->getHeader()->getName())
+					<< " fused with " << ore::NV("Previous", L1->getHeader()->getName());
+				if (Shift)
+				{
+					Remark << ", lagging " << ore::NV("Shift", *Shift) << " iterations behind";
+				}
+				if (Plan)
+				{
+					Remark << ", behind runtime checks";
+				}
+				if (Prologue)
+				{
+					Remark << ", " << ore::NV("Prologue", Prologue) << " leading iterations peeled";
+				}
+				if (Epi.Entry)
+				{
+					Remark << ", remaining iterations peeled";
+				}
+				return Remark;
+			});
+			NumFusions++;
+			Cache.countFusion();
+			Cache.markRefused(L1, L2, false);
+
+			/* Finally, fuse loops. L2 is erased from LoopInfo, so drop it from the set too */
+			{
+				PhaseScope Phase("fuse", "Fusion and cleanup");
+				Cache.invalidateFused(L1, L2);
+				fuse(L1, L2, LI, DTU, SE, Shift.has_value());
+				L1->setLoopID(LoopID);
+				if (Epi.Entry)
+				{
+					insertEpilogue(L1, Epi, LI, DTU);
+				}
+				if (EnableFusedBodyCleanup && cleanUpFusedBody(L1, LI, DTU.getDomTree(), Cache, AA))
+				{
+					Cache.invalidateNest(L1);
+					SE.forgetLoop(L1);
+				}
+				if (EnableArrayContraction && contractArrays(L1, DTU.getDomTree(), SE))
+				{
+					Cache.invalidateNest(L1);
+				}
+			}
+			if (DebugMode && Forecast)
+			{
+				errs()	<< "\tfused " << L1->getHeader()->getName() << " memory vectorizable: "
+					<< Cache.getAccessInfo(L1).canVectorizeMemory() << "\n";
+			}
+			it2 = set.erase(it2);
+			fused = true;
+			Cache.markIRModified();
+			fuseInnerLoops(L1, LI, DTU, SE, Cache, AA, DI, TTI, ORE);
+
+			/* The fast path runs under a condition now, so L1 is not control flow equivalent to the rest */
+			if (Plan)
+			{
+				Versioned = true;
+				break;
+			}
 		}
+		it1 = Versioned ? set.erase(it1) : std::next(it1);
 	}
-	return false;
+	return fused;
 } /* processSet */
 
 bool
-processLoops(const SmallVector<Loop *> &Loops, const DominatorTree &DT, const PostDominatorTree &PDT, ScalarEvolution &SE, DependenceInfo &DI)
+processLoops(const SmallVector<Loop *> &Loops, LoopInfo &LI, DomTreeUpdater &DTU, ScalarEvolution &SE, FusionCache &Cache, AAResults &AA, DependenceInfo &DI, const TargetTransformInfo &TTI,
+	OptimizationRemarkEmitter &ORE)
 {
 	/* Collect candidates */
-	std::set<Loop *> Candidates;
-	for (Loop *L : Loops)
+	SmallVector<Loop *> Candidates;
+	{
+		PhaseScope Phase("candidates", "Candidate collection");
+		for (Loop *L : Loops)
+		{
+			if (Cache.getFacts(L).IsCandidate)
+			{
+				Candidates.push_back(L);
+				continue;
+			}
+			if (Cache.markReported(L, nullptr))
+			{
+				ORE.emit([&]()
+				{
+					return OptimizationRemarkMissed(DEBUG_TYPE, "NotCandidate", L->getStartLoc(), L->getHeader())
+						<< "loop " << ore::NV("Loop", L->getHeader()->getName())
+						<< " is not fused: " << ore::NV("Reason", getCandidateBlocker(*L));
+				});
+			}
+		}
+	}
+	for (Loop *L : Candidates)
 	{
-		if	(
-			L->isLoopSimplifyForm()
-			&& (loopContainsVolatileInst(*L) == false)
-			&& (loopMightThrowException(*L) == false  || AllowThrow) /* Somehow always true */
-			&& (loopHasMultipleEntriesAndExits(*L) == false)
-			)
+		if (Cache.markCounted(L, nullptr))
 		{
-			Candidates.insert(L);
+			NumCandidates++;
 		}
 	}
 
 	/* Build Control Flow Equivalent sets */
-	std::list<std::list<Loop *>> CFEs = buildCFESets(Candidates, DT, PDT);
+	SmallVector<CFESet> CFEs;
+	{
+		PhaseScope Phase("cfe-sets", "Control flow equivalent sets");
+		CFEs = splitOversizedSets(buildCFESets(Candidates, DTU.getDomTree(), DTU.getPostDomTree()), ORE);
+	}
+	for (const CFESet &set : CFEs)
+	{
+		if (Cache.markCounted(nullptr, set.front()))
+		{
+			NumCFESets++;
+		}
+	}
+
+	/* Try to fuse loops from sets. A set goes back on the worklist only if it changed */
+	SmallVector<CFESet *, 8> Worklist;
+	for (auto &set : reverse(CFEs))
+	{
+		Worklist.push_back(&set);
+	}
 
-	/* Try to fuse any loops from sets */
 	bool fused = false;
-	for (auto &set : CFEs)
+	while (!Worklist.empty())
 	{
-		fused |= processSet(set, SE, DI);
+		CFESet *set = Worklist.pop_back_val();
+		if (processSet(*set, LI, DTU, SE, Cache, AA, DI, TTI, ORE))
+		{
+			fused = true;
+			if (set->size() > 1)
+			{
+				Worklist.push_back(set);
+			}
+		}
 	}
 	return fused;
 } /* processLoops */
@@ -880,40 +3768,40 @@ FuseLoops(Function &F, FunctionAnalysisManager &FAM)
 		errs() << "Func: " << F.getName() << "\n";
 		errs() << "\tloop count before: " << LoopCount << "\n";
 	}
+	/* Get analyses. They are kept up to date by fuse() and tryMakeLoopsAdjacent() */
+	LoopInfo          &LI  = FAM.getResult<LoopAnalysis>(F);
+	DominatorTree     &DT  = FAM.getResult<DominatorTreeAnalysis>(F);
+	PostDominatorTree &PDT = FAM.getResult<PostDominatorTreeAnalysis>(F);
+	ScalarEvolution   &SE  = FAM.getResult<ScalarEvolutionAnalysis>(F);
+	AAResults         &AA  = FAM.getResult<AAManager>(F);
+	DependenceInfo    &DI  = FAM.getResult<DependenceAnalysis>(F);
+	TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
+	LoopAccessInfoManager &LAIs = FAM.getResult<LoopAccessAnalysis>(F);
+	OptimizationRemarkEmitter &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+	DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+	FusionCache Cache(SE, TTI, LAIs);
+
+	/* Sets at a depth are drained before going deeper, so each depth is visited once. Inner loops of fused pairs are
+	   fused by processSet right away, revisiting them at the next depth hits cached verdicts */
 	SmallVector<Loop *> LoopsToProcess;
-	unsigned i = 1;
-	while (true)
+	for (unsigned i = 1; ; i++)
 	{
-		/* Get analyses */
-		LoopInfo          &LI  = FAM.getResult<LoopAnalysis>(F);
-		DominatorTree     &DT  = FAM.getResult<DominatorTreeAnalysis>(F);
-		PostDominatorTree &PDT = FAM.getResult<PostDominatorTreeAnalysis>(F);
-		ScalarEvolution   &SE  = FAM.getResult<ScalarEvolutionAnalysis>(F);
-		DependenceInfo    &DI  = FAM.getResult<DependenceAnalysis>(F);
-
 		LoopsToProcess = collectLoopsAtDepth(LI, i);
 		if (LoopsToProcess.empty())
 		{
 			break;
 		}
 
-		bool FusedAny = processLoops(LoopsToProcess, DT, PDT, SE, DI);
-		if (FusedAny)
-		{
-			changed = true;
-
-			/* Invalidate analyses since CFG changed */
-			FAM.invalidate(F, PreservedAnalyses::none());
-		}
-		else
-		{
-			i++;
-		}
+		processLoops(LoopsToProcess, LI, DTU, SE, Cache, AA, DI, TTI, ORE);
 	}
+	/* Not only fusions: a rejected pair may have been made adjacent already */
+	changed = Cache.isIRModified();
+	NumPairsRefused += Cache.getNumRefused();
 	if (DebugMode)
 	{
 		if (changed)
-			LoopCount = FAM.getResult<LoopAnalysis>(F).getLoopsInPreorder().size();
+			LoopCount = LI.getLoopsInPreorder().size();
 		errs()	<< "\tloop count after : " << LoopCount << "\n";
 	}
 	return changed;
@@ -925,7 +3813,19 @@ struct FusionPass : PassInfoMixin<FusionPass>
 	run(Function &F, FunctionAnalysisManager &FAM) 
 	{
 		bool changed = FuseLoops(F, FAM);
-		return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+		if (!changed)
+		{
+			return PreservedAnalyses::all();
+		}
+
+		/* CFG changed, but these are updated incrementally during fusion and adjacency fixing. ScalarEvolution forgets
+		   the loops every transform touches */
+		PreservedAnalyses PA;
+		PA.preserve<DominatorTreeAnalysis>();
+		PA.preserve<PostDominatorTreeAnalysis>();
+		PA.preserve<LoopAnalysis>();
+		PA.preserve<ScalarEvolutionAnalysis>();
+		return PA;
 	}
 
 	static bool 
@@ -936,9 +3836,53 @@ struct FusionPass : PassInfoMixin<FusionPass>
 };
 } /* namespace */
 
+bool
+shouldInsertAt(FusionExtensionPoint EP, OptimizationLevel Level)
+{
+	return FusionExtensionPoints.isSet(EP) && Level.getSpeedupLevel() >= FusionMinOptLevel;
+} /* shouldInsertAt */
+
 void
 CallBackForPassBuilder(PassBuilder &PB)
 {
+	/* Flags are read when the pipeline is built, after the command line is parsed */
+	PB.registerVectorizerStartEPCallback(
+		[](FunctionPassManager &FPM, OptimizationLevel Level)
+		{
+			if (shouldInsertAt(EP_VectorizerStart, Level))
+			{
+				FPM.addPass(FusionPass());
+			}
+		}
+	);
+	PB.registerScalarOptimizerLateEPCallback(
+		[](FunctionPassManager &FPM, OptimizationLevel Level)
+		{
+			if (shouldInsertAt(EP_ScalarOptimizerLate, Level))
+			{
+				FPM.addPass(FusionPass());
+			}
+		}
+	);
+	PB.registerFullLinkTimeOptimizationLastEPCallback(
+		[](ModulePassManager &MPM, OptimizationLevel Level)
+		{
+			if (shouldInsertAt(EP_LTO, Level))
+			{
+				MPM.addPass(createModuleToFunctionPassAdaptor(FusionPass()));
+			}
+		}
+	);
+	PB.registerOptimizerLastEPCallback(
+		[](ModulePassManager &MPM, OptimizationLevel Level, ThinOrFullLTOPhase Phase)
+		{
+			if (Phase == ThinOrFullLTOPhase::ThinLTOPostLink && shouldInsertAt(EP_LTO, Level))
+			{
+				MPM.addPass(createModuleToFunctionPassAdaptor(FusionPass()));
+			}
+		}
+	);
+
 	PB.registerPipelineParsingCallback(
 		(	[](
 			StringRef Name,
@@ -0,0 +1,65 @@
+/* Common driver of the fusion benchmarks. A kernel file defines
+ *   void bench_init(size_t n)      allocate and fill arrays of n elements
+ *   void bench_kernel(size_t n)    the timed loops
+ *   double bench_checksum(size_t n)
+ * and includes this header.
+ * Usage: <kernel> <elements per array>
+ * Prints seconds per kernel call and the checksum */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Element updates per timed run, small sizes repeat the kernel more often */
+#ifndef BENCH_WORK
+#define BENCH_WORK (1UL << 27)
+#endif
+
+void bench_init(size_t n);
+void bench_kernel(size_t n);
+double bench_checksum(size_t n);
+
+static void *
+bench_alloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+	if (!p)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <elements>\n", argv[0]);
+		return 1;
+	}
+	size_t n = strtoul(argv[1], NULL, 10);
+	size_t reps = n < BENCH_WORK ? BENCH_WORK / n : 1;
+
+	bench_init(n);
+	/* Warm up caches and page tables */
+	bench_kernel(n);
+
+	double start = bench_now();
+	for (size_t r = 0; r < reps; r++)
+	{
+		bench_kernel(n);
+	}
+	double elapsed = bench_now() - start;
+
+	printf("%.9f %.17g\n", elapsed / reps, bench_checksum(n));
+	return 0;
+}
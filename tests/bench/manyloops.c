@@ -0,0 +1,40 @@
+/* Kernels of fusion-manyloops-input.c on arrays of n elements, the ones expected to stay unfused included */
+#define main manyloops_main
+#include "../fusion-manyloops-input.c"
+#undef main
+
+#include "bench.h"
+
+static int *a, *b, *c;
+
+__attribute__((noinline)) void
+bench_kernel(size_t n)
+{
+	doit1_should(a, n);
+	simple_1_should(b, c, (int)n);
+	diff_directions_shouldnot(b, c, (int)n);
+	ambiguous_dependence_shouldnot(b, c, (int)n);
+}
+
+void
+bench_init(size_t n)
+{
+	a = bench_alloc(n, sizeof(int));
+	b = bench_alloc(n, sizeof(int));
+	c = bench_alloc(n, sizeof(int));
+	for (size_t i = 0; i < n; i++)
+	{
+		a[i] = (int)i;
+	}
+}
+
+double
+bench_checksum(size_t n)
+{
+	double sum = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		sum += a[i] + b[i] + c[i];
+	}
+	return sum;
+}
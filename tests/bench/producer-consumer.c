@@ -0,0 +1,45 @@
+/* A chain of loops, each consuming what the previous one produced in the same iteration */
+#include "bench.h"
+
+static float *in, *t1, *t2, *out;
+
+__attribute__((noinline)) void
+bench_kernel(size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		t1[i] = in[i] * 0.5f + 1.0f;
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		t2[i] = t1[i] * t1[i];
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		out[i] = t2[i] - t1[i] + in[i];
+	}
+}
+
+void
+bench_init(size_t n)
+{
+	in = bench_alloc(n, sizeof(float));
+	t1 = bench_alloc(n, sizeof(float));
+	t2 = bench_alloc(n, sizeof(float));
+	out = bench_alloc(n, sizeof(float));
+	for (size_t i = 0; i < n; i++)
+	{
+		in[i] = (float)(i % 1000) / 1000.0f;
+	}
+}
+
+double
+bench_checksum(size_t n)
+{
+	double sum = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		sum += out[i];
+	}
+	return sum;
+}
@@ -0,0 +1,44 @@
+/* Independent reductions over the same arrays: sum, dot product and maximum */
+#include "bench.h"
+
+static double *x, *y;
+static double sum, dot, max;
+
+__attribute__((noinline)) void
+bench_kernel(size_t n)
+{
+	double s = 0, p = 0, m = x[0];
+	for (size_t i = 0; i < n; i++)
+	{
+		s += x[i];
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		p += x[i] * y[i];
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		m = y[i] > m ? y[i] : m;
+	}
+	sum = s;
+	dot = p;
+	max = m;
+}
+
+void
+bench_init(size_t n)
+{
+	x = bench_alloc(n, sizeof(double));
+	y = bench_alloc(n, sizeof(double));
+	for (size_t i = 0; i < n; i++)
+	{
+		x[i] = 1.0 / (i + 1);
+		y[i] = (double)(i % 101);
+	}
+}
+
+double
+bench_checksum(size_t n)
+{
+	return sum + dot + max;
+}
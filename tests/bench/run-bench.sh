@@ -0,0 +1,57 @@
+#!/bin/bash
+# Runs every <kernel>-base/<kernel>-fused pair in BIN_DIR at each size RUNS times
+# and writes the median time per kernel call and the speedup as CSV.
+# Usage: run-bench.sh BIN_DIR CSV_FILE RUNS SIZE...
+
+if [ $# -lt 4 ]; then
+    echo "usage: $0 BIN_DIR CSV_FILE RUNS SIZE..."
+    exit 1
+fi
+
+BIN_DIR=$1
+CSV_FILE=$2
+RUNS=$3
+shift 3
+SIZES="$@"
+
+# Prints "median_seconds checksum" of RUNS runs of $1 at size $2
+measure() {
+    local times=()
+    local checksum=""
+    for ((r = 0; r < RUNS; r++)); do
+        read -r t sum < <("$1" "$2")
+        if [ -z "$t" ]; then
+            echo "$1 $2 failed" >&2
+            return 1
+        fi
+        times+=("$t")
+        checksum=$sum
+    done
+    local median
+    median=$(printf "%s\n" "${times[@]}" | sort -g | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }')
+    echo "$median $checksum"
+}
+
+echo "kernel,elements,base_seconds,fused_seconds,speedup,checksum_match" > "$CSV_FILE"
+status=0
+for base in "$BIN_DIR"/*-base; do
+    kernel=$(basename "$base" -base)
+    fused="$BIN_DIR/$kernel-fused"
+    for size in $SIZES; do
+        read -r base_time base_sum < <(measure "$base" "$size") || { status=1; continue; }
+        read -r fused_time fused_sum < <(measure "$fused" "$size") || { status=1; continue; }
+        match=yes
+        if [ "$base_sum" != "$fused_sum" ]; then
+            match=no
+            status=1
+        fi
+        speedup=$(awk -v b="$base_time" -v f="$fused_time" 'BEGIN { printf "%.3f", (f > 0) ? b / f : 0 }')
+        echo "$kernel,$size,$base_time,$fused_time,$speedup,$match" >> "$CSV_FILE"
+    done
+done
+
+cat "$CSV_FILE"
+if [ $status -ne 0 ]; then
+    echo "Some runs failed or checksums differ."
+fi
+exit $status
@@ -0,0 +1,40 @@
+/* Two 3-point smoothing sweeps. The second sweep reads the neighbour the first one writes an iteration later */
+#include "bench.h"
+
+static double *a, *b, *c;
+
+__attribute__((noinline)) void
+bench_kernel(size_t n)
+{
+	for (size_t i = 1; i < n - 1; i++)
+	{
+		b[i] = (a[i - 1] + a[i] + a[i + 1]) * (1.0 / 3.0);
+	}
+	for (size_t i = 1; i < n - 1; i++)
+	{
+		c[i] = (b[i - 1] + b[i] + b[i + 1]) * (1.0 / 3.0);
+	}
+}
+
+void
+bench_init(size_t n)
+{
+	a = bench_alloc(n, sizeof(double));
+	b = bench_alloc(n, sizeof(double));
+	c = bench_alloc(n, sizeof(double));
+	for (size_t i = 0; i < n; i++)
+	{
+		a[i] = (double)(i % 17);
+	}
+}
+
+double
+bench_checksum(size_t n)
+{
+	double sum = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		sum += c[i];
+	}
+	return sum;
+}
@@ -0,0 +1,56 @@
+/* Two 5-point Jacobi sweeps on a square grid of about n points */
+#include "bench.h"
+
+#include <math.h>
+
+static double *a, *b, *c;
+static size_t side;
+
+__attribute__((noinline)) void
+bench_kernel(size_t n)
+{
+	for (size_t i = 1; i < side - 1; i++)
+	{
+		for (size_t j = 1; j < side - 1; j++)
+		{
+			b[i * side + j] = 0.2 * (a[i * side + j] + a[(i - 1) * side + j] + a[(i + 1) * side + j]
+				+ a[i * side + j - 1] + a[i * side + j + 1]);
+		}
+	}
+	for (size_t i = 1; i < side - 1; i++)
+	{
+		for (size_t j = 1; j < side - 1; j++)
+		{
+			c[i * side + j] = 0.2 * (b[i * side + j] + b[(i - 1) * side + j] + b[(i + 1) * side + j]
+				+ b[i * side + j - 1] + b[i * side + j + 1]);
+		}
+	}
+}
+
+void
+bench_init(size_t n)
+{
+	side = (size_t)sqrt((double)n);
+	if (side < 3)
+	{
+		side = 3;
+	}
+	a = bench_alloc(side * side, sizeof(double));
+	b = bench_alloc(side * side, sizeof(double));
+	c = bench_alloc(side * side, sizeof(double));
+	for (size_t i = 0; i < side * side; i++)
+	{
+		a[i] = (double)(i % 13);
+	}
+}
+
+double
+bench_checksum(size_t n)
+{
+	double sum = 0;
+	for (size_t i = 0; i < side * side; i++)
+	{
+		sum += c[i];
+	}
+	return sum;
+}
@@ -0,0 +1,50 @@
+/* STREAM copy, scale, add and triad as four loops over the same arrays */
+#include "bench.h"
+
+static double *a, *b, *c, *d;
+
+__attribute__((noinline)) void
+bench_kernel(size_t n)
+{
+	const double s = 3.0;
+	for (size_t i = 0; i < n; i++)
+	{
+		c[i] = a[i];
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		b[i] = s * c[i];
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		c[i] = a[i] + b[i];
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		d[i] = b[i] + s * c[i];
+	}
+}
+
+void
+bench_init(size_t n)
+{
+	a = bench_alloc(n, sizeof(double));
+	b = bench_alloc(n, sizeof(double));
+	c = bench_alloc(n, sizeof(double));
+	d = bench_alloc(n, sizeof(double));
+	for (size_t i = 0; i < n; i++)
+	{
+		a[i] = 1.0 / (i + 1);
+	}
+}
+
+double
+bench_checksum(size_t n)
+{
+	double sum = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		sum += b[i] + c[i] + d[i];
+	}
+	return sum;
+}
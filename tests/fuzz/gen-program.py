@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+"""Random C loop programs for differential testing of fusion-pass.
+
+A program is one noinline kernel of top-level loop nests over four pointer parameters, called from main with
+pointers into global buffers. Parameters may point into the same buffer, so the kernel sees may-alias accesses
+that only runtime checks can separate. All arithmetic is unsigned and every index stays inside the buffers, so
+programs are free of undefined behaviour and print the same output with and without fusion.
+
+The program is kept as a small model, so failing cases can be minimized by dropping loops and statements."""
+
+import argparse
+import copy
+import random
+
+ARRAYS = 4
+MAX_OFFSET = 2      # |i + offset| stays within [-2, bound + 2]
+PARAM_BASE = (2, 8) # parameters start this far into a buffer, before index -MAX_OFFSET is valid
+SLACK = 32          # buffers are N + SLACK elements long
+OPS = ["+", "-", "*", "^", "&", "|"]
+
+
+class Loop:
+    def __init__(self, lower, upper, statements, inner=None):
+        self.lower = lower          # first index
+        self.upper = upper          # bound expression, "n" or "n - 1" ...
+        self.statements = statements
+        self.inner = inner          # (upper, statements) of an inner loop over j, or None
+
+
+class Program:
+    def __init__(self, seed, size, symbolic, params, loops, between):
+        self.seed = seed
+        self.size = size            # N
+        self.symbolic = symbolic    # trip counts depend on a runtime value
+        self.params = params        # (buffer, base offset) of every pointer parameter
+        self.loops = loops
+        self.between = between      # statements after loop k, by k
+
+
+def random_operand(rng, index):
+    kind = rng.random()
+    if kind < 0.7:
+        return "P%d[%s%+d]" % (rng.randrange(ARRAYS), index, rng.randint(-MAX_OFFSET, MAX_OFFSET))
+    if kind < 0.85:
+        return "(unsigned)%s" % index
+    return "%du" % rng.randrange(1, 100)
+
+
+def random_expression(rng, index, depth=0):
+    if depth >= 2 or rng.random() < 0.4:
+        return random_operand(rng, index)
+    return "(%s %s %s)" % (random_expression(rng, index, depth + 1), rng.choice(OPS), random_expression(rng, index, depth + 1))
+
+
+def random_statement(rng, index):
+    kind = rng.random()
+    target = "P%d[%s%+d]" % (rng.randrange(ARRAYS), index, rng.randint(-MAX_OFFSET, MAX_OFFSET))
+    if kind < 0.6:
+        return "%s = %s;" % (target, random_expression(rng, index))
+    if kind < 0.85:
+        return "s%d %s= %s;" % (rng.randrange(3), rng.choice(["+", "^", "*"]), random_expression(rng, index))
+    condition = "P%d[%s%+d]" % (rng.randrange(ARRAYS), index, rng.randint(-MAX_OFFSET, MAX_OFFSET))
+    return "if (%s & 1u) %s = %s;" % (condition, target, random_expression(rng, index))
+
+
+def generate(seed):
+    rng = random.Random(seed)
+    size = rng.choice([1, 2, 7, 16, 33, 64])
+    symbolic = rng.random() < 0.5
+    params = []
+    for _ in range(ARRAYS):
+        # Sharing a buffer makes the parameters alias
+        buffer = rng.randrange(ARRAYS) if rng.random() < 0.3 else len(params)
+        params.append((buffer, rng.randint(*PARAM_BASE)))
+
+    bounds = ["n", "n", "n", "n - 1", "n + 1", "n + 2", "n - 3"]
+    loops = []
+    between = {}
+    for k in range(rng.randint(2, 6)):
+        lower = rng.choice([0, 0, 0, 1, 2])
+        upper = rng.choice(bounds)
+        if rng.random() < 0.25:
+            inner_upper = rng.choice(["n", "n", "n - 1"])
+            inner = (inner_upper, [random_statement(rng, "j") for _ in range(rng.randint(1, 3))])
+            statements = [random_statement(rng, "i") for _ in range(rng.randint(0, 1))]
+        else:
+            inner = None
+            statements = [random_statement(rng, "i") for _ in range(rng.randint(1, 4))]
+        loops.append(Loop(lower, upper, statements, inner))
+        if rng.random() < 0.2:
+            between[k] = ["s%d = s%d * 3u + P%d[%d];" % (rng.randrange(3), rng.randrange(3), rng.randrange(ARRAYS), rng.randrange(MAX_OFFSET + 1))]
+    return Program(seed, size, symbolic, params, loops, between)
+
+
+def render(program):
+    n = program.size
+    lines = [
+        "/* fusion fuzz program, seed %d */" % program.seed,
+        "#include <stdio.h>",
+        "",
+        "#define N %d" % n,
+        "unsigned G[%d][N + %d];" % (ARRAYS, SLACK),
+        "",
+        "__attribute__((noinline)) static void",
+        "kernel(%s, int n)" % ", ".join("unsigned *P%d" % a for a in range(ARRAYS)),
+        "{",
+        "\tunsigned s0 = 1, s1 = 2, s2 = 3;",
+    ]
+    for k, loop in enumerate(program.loops):
+        lines.append("\tfor (int i = %d; i < %s; i++)" % (loop.lower, loop.upper))
+        lines.append("\t{")
+        for statement in loop.statements:
+            lines.append("\t\t" + statement)
+        if loop.inner:
+            # Inner indices stay in range because j is bounded like i
+            lines.append("\t\tfor (int j = 0; j < %s; j++)" % loop.inner[0])
+            lines.append("\t\t{")
+            for statement in loop.inner[1]:
+                lines.append("\t\t\t" + statement)
+            lines.append("\t\t}")
+        lines.append("\t}")
+        for statement in program.between.get(k, []):
+            lines.append("\t" + statement)
+    lines += [
+        "\tprintf(\"%u %u %u\\n\", s0, s1, s2);",
+        "}",
+        "",
+        "int",
+        "main(int argc, char **argv)",
+        "{",
+        "\t/* Opaque to the optimizer when symbolic, so trip counts are not constants */",
+        "\tint n = %s;" % ("argc > 100 ? argc : N" if program.symbolic else "N"),
+        "\tfor (int a = 0; a < %d; a++)" % ARRAYS,
+        "\t\tfor (int i = 0; i < N + %d; i++)" % SLACK,
+        "\t\t\tG[a][i] = (unsigned)(i * (2 * a + 3) + a) & 0xffu;",
+        "\tkernel(%s, n);" % ", ".join("G[%d] + %d" % param for param in program.params),
+        "\tfor (int a = 0; a < %d; a++)" % ARRAYS,
+        "\t{",
+        "\t\tunsigned h = 0;",
+        "\t\tfor (int i = 0; i < N + %d; i++)" % SLACK,
+        "\t\t\th = h * 31u + G[a][i];",
+        "\t\tprintf(\"%u\\n\", h);",
+        "\t}",
+        "\treturn 0;",
+        "}",
+    ]
+    return "\n".join(lines) + "\n"
+
+
+def reductions(program):
+    """Smaller variants of the program, most aggressive first"""
+    for k in range(len(program.loops)):
+        smaller = copy.deepcopy(program)
+        del smaller.loops[k]
+        smaller.between = {(b if b < k else b - 1): s for b, s in program.between.items() if b != k}
+        yield smaller
+    for k in program.between:
+        smaller = copy.deepcopy(program)
+        del smaller.between[k]
+        yield smaller
+    for k, loop in enumerate(program.loops):
+        if loop.inner:
+            smaller = copy.deepcopy(program)
+            smaller.loops[k].inner = None
+            if smaller.loops[k].statements:
+                yield smaller
+            for s in range(len(loop.inner[1])):
+                if len(loop.inner[1]) > 1:
+                    smaller = copy.deepcopy(program)
+                    del smaller.loops[k].inner[1][s]
+                    yield smaller
+        for s in range(len(loop.statements)):
+            if len(loop.statements) > 1 or loop.inner:
+                smaller = copy.deepcopy(program)
+                del smaller.loops[k].statements[s]
+                yield smaller
+        if loop.lower != 0 or loop.upper != "n":
+            smaller = copy.deepcopy(program)
+            smaller.loops[k].lower = 0
+            smaller.loops[k].upper = "n"
+            yield smaller
+    if program.size > 1:
+        smaller = copy.deepcopy(program)
+        smaller.size = max(1, program.size // 2)
+        yield smaller
+    if program.symbolic:
+        smaller = copy.deepcopy(program)
+        smaller.symbolic = False
+        yield smaller
+
+
+def minimize(program, still_fails):
+    """Greedily applies reductions while still_fails(program) holds"""
+    changed = True
+    while changed:
+        changed = False
+        for smaller in reductions(program):
+            if still_fails(smaller):
+                program = smaller
+                changed = True
+                break
+    return program
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("seed", type=int)
+    args = parser.parse_args()
+    print(render(generate(args.seed)), end="")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""Differential fuzzing of fusion-pass with programs from gen-program.py.
+
+Every seed is compiled to IR, run through a pre-pass pipeline and then through fusion-pass. The fused IR has to pass
+opt -passes=verify, and the binaries built from the IR before and after fusion have to print the same output.
+Failing seeds are minimized by dropping loops and statements while the failure keeps its kind; the original and
+the minimized program are written to the failure directory. Seeds run in parallel on all cores."""
+
+import argparse
+import importlib.util
+import multiprocessing
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+PIPELINES = ["mem2reg", "mem2reg,loop-simplify,lcssa,loop-rotate"]
+
+FLAG_SETS = [
+    [],
+    ["-fusion-versioning"],
+    ["-fusion-versioning", "-fusion-threshold=-1000000", "-fusion-vectorization=ignore"],
+    ["-max-fusion-peel=0", "-max-fusion-shift=0"],
+    ["-fusion-cleanup=false", "-fusion-contract-arrays=false"],
+]
+
+spec = importlib.util.spec_from_file_location("gen_program", os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                                                          "gen-program.py"))
+gen_program = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(gen_program)
+
+
+class Failure:
+    def __init__(self, kind, detail):
+        self.kind = kind    # crash, verify, compile, timeout or mismatch
+        self.detail = detail
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--clang", required=True, help="clang binary")
+    parser.add_argument("--opt", required=True, help="opt binary")
+    parser.add_argument("--plugin", required=True, help="libfusion-pass.so")
+    parser.add_argument("--seeds", default="0:1000", help="FIRST:COUNT, a COUNT of 0 runs until interrupted")
+    parser.add_argument("--jobs", type=int, default=os.cpu_count(), help="parallel seeds")
+    parser.add_argument("--timeout", type=float, default=10, help="seconds per command")
+    parser.add_argument("--failures", default="fuzz-failures", help="directory for failing programs")
+    parser.add_argument("--opt-flag", action="append", default=[],
+                        help="extra fusion-pass flag for every seed, e.g. --opt-flag=-fusion-versioning")
+    parser.add_argument("--no-minimize", action="store_true", help="keep failing programs as generated")
+    return parser.parse_args()
+
+
+def configuration(seed):
+    """Pre-pass pipeline and fusion-pass flags of a seed"""
+    rng = random.Random(~seed)
+    return rng.choice(PIPELINES), rng.choice(FLAG_SETS)
+
+
+def call(command, timeout):
+    """Exit code (None on timeout) and output of a command"""
+    try:
+        result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, timeout=timeout)
+    except subprocess.TimeoutExpired:
+        return None, ""
+    return result.returncode, result.stdout.decode(errors="replace")
+
+
+def check(program, pipeline, flags, args, tmp):
+    """Failure of the program or None"""
+    source = os.path.join(tmp, "program.c")
+    with open(source, "w") as f:
+        f.write(gen_program.render(program))
+    ir = os.path.join(tmp, "input.ll")
+    base = os.path.join(tmp, "base.ll")
+    fused = os.path.join(tmp, "fused.ll")
+
+    for command in ([args.clang, "-O0", "-Xclang", "-disable-O0-optnone", "-S", "-emit-llvm", source, "-o", ir],
+                    [args.opt, "-S", "-passes=" + pipeline, ir, "-o", base],
+                    [args.clang, "-O0", base, "-o", base + ".bin"]):
+        code, output = call(command, args.timeout)
+        if code != 0:
+            # The reference side never runs fusion-pass, a failure here is a bug of the harness or the toolchain
+            raise RuntimeError("%s failed:\n%s" % (" ".join(command), output))
+
+    code, output = call([args.opt, "-load-pass-plugin", args.plugin, "-passes=fusion-pass", "-S"] + flags
+                        + args.opt_flag + [base, "-o", fused], args.timeout)
+    if code is None:
+        return Failure("timeout", "fusion-pass did not finish")
+    if code != 0:
+        return Failure("crash", output)
+    code, output = call([args.opt, "-passes=verify", "-disable-output", fused], args.timeout)
+    if code != 0:
+        return Failure("verify", output)
+    code, output = call([args.clang, "-O0", fused, "-o", fused + ".bin"], args.timeout)
+    if code != 0:
+        return Failure("compile", output)
+
+    expected = call([base + ".bin"], args.timeout)
+    actual = call([fused + ".bin"], args.timeout)
+    if actual[0] is None and expected[0] is not None:
+        return Failure("timeout", "fused program did not finish")
+    if actual != expected:
+        return Failure("mismatch", "expected (exit %s):\n%s\nactual (exit %s):\n%s"
+                       % (expected[0], expected[1], actual[0], actual[1]))
+    return None
+
+
+def fuzz(seed, args):
+    """Checks one seed, writes it to the failure directory if it fails and returns the failure kind"""
+    pipeline, flags = configuration(seed)
+    program = gen_program.generate(seed)
+    with tempfile.TemporaryDirectory() as tmp:
+        failure = check(program, pipeline, flags, args, tmp)
+        if failure is None:
+            return seed, None
+
+        directory = os.path.join(args.failures, "seed-%d" % seed)
+        os.makedirs(directory, exist_ok=True)
+        with open(os.path.join(directory, "original.c"), "w") as f:
+            f.write(gen_program.render(program))
+        if not args.no_minimize:
+            def still_fails(smaller):
+                result = check(smaller, pipeline, flags, args, tmp)
+                return result is not None and result.kind == failure.kind
+            program = gen_program.minimize(program, still_fails)
+            failure = check(program, pipeline, flags, args, tmp)
+            with open(os.path.join(directory, "minimized.c"), "w") as f:
+                f.write(gen_program.render(program))
+        with open(os.path.join(directory, "failure.txt"), "w") as f:
+            f.write("kind: %s\npre-passes: %s\nfusion flags: %s\n\n%s\n"
+                    % (failure.kind, pipeline, " ".join(flags + args.opt_flag), failure.detail))
+        return seed, failure.kind
+
+
+def fuzz_task(task):
+    """Pool workers need a picklable function of one argument"""
+    return fuzz(*task)
+
+
+def main():
+    args = parse_args()
+    first, count = (int(x) for x in args.seeds.split(":"))
+    failures = 0
+    checked = 0
+    batch = 16 * args.jobs
+    with multiprocessing.Pool(args.jobs) as pool:
+        try:
+            # Batches keep an endless run from queueing seeds without bound
+            while count == 0 or checked < count:
+                size = batch if count == 0 else min(batch, count - checked)
+                tasks = [(seed, args) for seed in range(first + checked, first + checked + size)]
+                for seed, kind in pool.imap_unordered(fuzz_task, tasks):
+                    if kind is not None:
+                        failures += 1
+                        print("seed %d: %s, see %s" % (seed, kind, os.path.join(args.failures, "seed-%d" % seed)),
+                              flush=True)
+                checked += size
+                print("%d seeds, %d failures" % (checked, failures), flush=True)
+        except KeyboardInterrupt:
+            pool.terminate()
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,51 @@
+/* Cleanup: the second load of x[i] in the fused body reuses the first one, unless the first one does not dominate it */
+// FUSED: cleanup_reuse 1
+// FUSED: cleanup_branch 1
+// IR-COUNT: cleanup_reuse 1 = load i32
+// IR-COUNT: cleanup_branch 3 = load i32
+#include <stdio.h>
+
+#define N 64
+
+int x[N], flag[N], a[N], b[N];
+
+void
+cleanup_reuse(void)
+{
+	for (long i = 0; i < N; i++)
+		a[i] = x[i] * 2;
+	for (long i = 0; i < N; i++)
+		b[i] = x[i] + 1;
+}
+
+void
+cleanup_branch(void)
+{
+	for (long i = 0; i < N; i++)
+		if (flag[i])
+			a[i] = x[i] * 3;
+	for (long i = 0; i < N; i++)
+		b[i] = x[i] - 1;
+}
+
+static void
+print(void)
+{
+	unsigned long s = 0;
+	for (int i = 0; i < N; i++)
+		s = s * 31 + a[i] * 7 + b[i];
+	printf("%lu\n", s);
+}
+
+int
+main(void)
+{
+	for (int i = 0; i < N; i++)
+	{
+		x[i] = 11 * i + 2;
+		flag[i] = i % 3 == 0;
+	}
+	cleanup_reuse(); print();
+	cleanup_branch(); print();
+	return 0;
+}
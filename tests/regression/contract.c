@@ -0,0 +1,51 @@
+/* Array contraction: a local array stored and reloaded within one iteration of the fused loop is deleted, one that
+   is read after the loops is kept */
+// FUSED: contract_local 1
+// FUSED: contract_live 1
+// IR-COUNT: contract_local 0 %tmp = alloca
+// IR-COUNT: contract_live 1 %tmp = alloca
+#include <stdio.h>
+
+#define N 64
+
+int b[N], c[N];
+
+void
+contract_local(void)
+{
+	int tmp[N];
+	for (int i = 0; i < N; i++)
+		tmp[i] = b[i] * 3;
+	for (int i = 0; i < N; i++)
+		c[i] = tmp[i] + 1;
+}
+
+void
+contract_live(void)
+{
+	int tmp[N];
+	for (int i = 0; i < N; i++)
+		tmp[i] = b[i] * 5;
+	for (int i = 0; i < N; i++)
+		c[i] = tmp[i] - 1;
+	c[0] += tmp[N / 2];
+}
+
+static void
+print(void)
+{
+	unsigned long s = 0;
+	for (int i = 0; i < N; i++)
+		s = s * 31 + c[i];
+	printf("%lu\n", s);
+}
+
+int
+main(void)
+{
+	for (int i = 0; i < N; i++)
+		b[i] = 9 * i + 4;
+	contract_local(); print();
+	contract_live(); print();
+	return 0;
+}
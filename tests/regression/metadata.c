@@ -0,0 +1,32 @@
+/* Loop metadata: the fused loop carries one merged llvm.loop node */
+// FUSED: metadata_merge 1
+// IR-COUNT: metadata_merge 1 !llvm.loop
+#include <stdio.h>
+
+#define N 64
+
+int a[N], b[N], c[N];
+
+void
+metadata_merge(void)
+{
+#pragma clang loop unroll(disable)
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] + 2;
+#pragma clang loop unroll(disable)
+	for (int i = 0; i < N; i++)
+		c[i] = a[i] * 5;
+}
+
+int
+main(void)
+{
+	for (int i = 0; i < N; i++)
+		b[i] = i * i;
+	metadata_merge();
+	unsigned long s = 0;
+	for (int i = 0; i < N; i++)
+		s = s * 31 + a[i] * 7 + c[i];
+	printf("%lu\n", s);
+	return 0;
+}
@@ -0,0 +1,47 @@
+/* Code between loops: a store that L1 overwrites can only sink below L2, one that both loops read can move nowhere */
+// FUSED: move_output 1
+// MISSED: move_anti CodeBetweenLoops
+#include <stdio.h>
+
+#define N 64
+
+int a[N], b[N], c[N];
+
+void
+move_output(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] + 1;
+	a[0] = 7;
+	for (int i = 0; i < N; i++)
+		c[i] = b[i] * 2;
+}
+
+void
+move_anti(void)
+{
+	for (int i = 0; i < N; i++)
+		b[i] = a[i] + 1;
+	a[0] = 9;
+	for (int i = 0; i < N; i++)
+		c[i] = a[i] * 2;
+}
+
+static void
+print(void)
+{
+	unsigned long s = 0;
+	for (int i = 0; i < N; i++)
+		s = s * 31 + a[i] * 7 + b[i] * 3 + c[i];
+	printf("%lu\n", s);
+}
+
+int
+main(void)
+{
+	for (int i = 0; i < N; i++)
+		b[i] = 3 * i + 2;
+	move_output(); print();
+	move_anti(); print();
+	return 0;
+}
@@ -0,0 +1,69 @@
+/* Peeling: trip counts differing by 3 are fused over the common range with the rest peeled, a difference of 20
+   exceeds -max-fusion-peel. A second loop starting 2 iterations later is aligned by a prologue, one starting 20
+   iterations later is not */
+// FUSED: peel_near 1
+// MISSED: peel_far TripCountMismatch
+// FUSED: peel_start 1
+// MISSED: peel_start_far DifferentIndex
+#include <stdio.h>
+
+#define N 64
+
+int a[N], b[N], c[N];
+
+void
+peel_near(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] + i;
+	for (int i = 0; i < N - 3; i++)
+		c[i] = b[i] * 2;
+}
+
+void
+peel_far(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] - i;
+	for (int i = 0; i < N - 20; i++)
+		c[i] = b[i] * 3;
+}
+
+void
+peel_start(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] * 5;
+	for (int i = 2; i < N; i++)
+		c[i] = b[i - 2] + i;
+}
+
+void
+peel_start_far(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] * 7;
+	for (int i = 20; i < N; i++)
+		c[i] = b[i - 20] - i;
+}
+
+static void
+print(void)
+{
+	unsigned long s = 0;
+	for (int i = 0; i < N; i++)
+		s = s * 31 + a[i] * 7 + c[i];
+	printf("%lu\n", s);
+}
+
+int
+main(void)
+{
+	for (int i = 0; i < N; i++)
+		b[i] = 5 * i + 1;
+	peel_near(); print();
+	peel_far(); print();
+	peel_start(); print();
+	peel_start_far(); print();
+	return 0;
+}
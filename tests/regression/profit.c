@@ -0,0 +1,43 @@
+/* Profitability: loops reading the same array are fused, loops that share no data gain nothing and are not */
+// FUSED: profit_reuse 1
+// MISSED: profit_disjoint Unprofitable
+#include <stdio.h>
+
+#define N 64
+
+int a[N], b[N], c[N], d[N], x[N], y[N];
+
+void
+profit_reuse(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = x[i] * 2;
+	for (int i = 0; i < N; i++)
+		b[i] = x[i] + 3;
+}
+
+void
+profit_disjoint(void)
+{
+	for (int i = 0; i < N; i++)
+		c[i] = x[i] * 5;
+	for (int i = 0; i < N; i++)
+		d[i] = y[i] - 1;
+}
+
+int
+main(void)
+{
+	for (int i = 0; i < N; i++)
+	{
+		x[i] = 7 * i + 1;
+		y[i] = 5 * i + 2;
+	}
+	profit_reuse();
+	profit_disjoint();
+	unsigned long s = 0;
+	for (int i = 0; i < N; i++)
+		s = s * 31 + a[i] * 7 + b[i] * 5 + c[i] * 3 + d[i];
+	printf("%lu\n", s);
+	return 0;
+}
@@ -0,0 +1,77 @@
+/* Rotated loops: plain bodies and loops guarded by the same condition are fused, a reduction is chained through the
+   fused header, a recurrence that is not a matching reduction is not */
+// PASSES: mem2reg,loop-simplify,lcssa,loop-rotate
+// FLAGS: -fusion-vectorization=ignore
+// FUSED: rotated_plain 1
+// FUSED: rotated_guarded 1
+// FUSED: rotated_reduction 1
+// MISSED: rotated_recurrence RotatedShape
+#include <stdio.h>
+
+#define N 64
+
+int a[N], b[N], c[N];
+
+void
+rotated_plain(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] + 1;
+	for (int i = 0; i < N; i++)
+		c[i] = a[i] * 2;
+}
+
+void
+rotated_guarded(int n)
+{
+	for (int i = 0; i < n; i++)
+		a[i] = b[i] - 1;
+	for (int i = 0; i < n; i++)
+		c[i] = a[i] * 3;
+}
+
+int
+rotated_reduction(void)
+{
+	int s = 0;
+	for (int i = 0; i < N; i++)
+		s += a[i];
+	for (int i = 0; i < N; i++)
+		s += a[i] ^ b[i];
+	return s;
+}
+
+unsigned
+rotated_recurrence(void)
+{
+	unsigned s = 1;
+	for (int i = 0; i < N; i++)
+		s = s * 2 + a[i];
+	for (int i = 0; i < N; i++)
+		s ^= a[i] + b[i];
+	return s;
+}
+
+static void
+print(void)
+{
+	unsigned long s = 0;
+	for (int i = 0; i < N; i++)
+		s = s * 31 + a[i] * 7 + c[i];
+	printf("%lu\n", s);
+}
+
+int
+main(int argc, char **argv)
+{
+	/* Opaque to the optimizer, so rotated_guarded keeps its guards */
+	int n = argc > 100 ? argc : N;
+	for (int i = 0; i < N; i++)
+		b[i] = 7 * i + 3;
+	rotated_plain(); print();
+	rotated_guarded(n); print();
+	rotated_guarded(0); print();
+	printf("%d\n", rotated_reduction());
+	printf("%u\n", rotated_recurrence());
+	return 0;
+}
@@ -0,0 +1,122 @@
+#!/bin/bash
+# Runs every C input of tests/regression through fusion-pass, checks the remarks and IR the input expects and
+# compares the output of the programs built from the IR before and after fusion. Run from the repository root:
+#   bash tests/regression/run-tests.sh [input.c ...]
+#
+# Directives in the inputs:
+#   // PASSES: <pipeline>                 passes run before fusion-pass, mem2reg by default
+#   // FLAGS: <flags>                     extra opt flags for fusion-pass
+#   // FUSED: <function> <n>              exactly n Fused remarks in function
+#   // MISSED: <function> <name>          at least one missed remark <name> in function
+#   // IR-COUNT: <function> <n> <regex>   exactly n lines of the fused function match regex
+
+CLANG="./../build/bin/clang-20"
+OPT="./../build/bin/opt"
+PLUGIN_PATH="./build/libfusion-pass.so"
+
+TEST_DIR="./tests/regression"
+OUT_DIR="regression-out"
+
+mkdir -p $OUT_DIR
+
+if [ $# -eq 0 ]; then
+    set -- $TEST_DIR/*.c
+fi
+
+FAILED=0
+
+fail() {
+    echo "$NAME: $1"
+    FAILED=$((FAILED + 1))
+}
+
+# Prints "<remark name> <function>" for every remark record of the YAML file
+remarks() {
+    awk '/^--- /{ if (name != "") print name, fn; name = ""; fn = "" }
+         /^Name:/{ name = $2 }
+         /^Function:/{ fn = $2 }
+         END{ if (name != "") print name, fn }' "$1" | tr -d "'\""
+}
+
+# Prints the body of function $2 in the IR file $1
+function_ir() {
+    awk -v fn="@$2(" 'index($0, "define ") == 1 && index($0, fn) { on = 1 } on { print } on && /^}/ { on = 0 }' "$1"
+}
+
+for INPUT_FILE in "$@"; do
+    NAME=$(basename $INPUT_FILE .c)
+    EXE_INPUT="$OUT_DIR/$NAME-input.bin"
+    EXE_OUTPUT="$OUT_DIR/$NAME-output.bin"
+    LL_INPUT="$OUT_DIR/$NAME-input.ll"
+    LL_OUTPUT="$OUT_DIR/$NAME-output.ll"
+    REMARKS="$OUT_DIR/$NAME-remarks.yaml"
+    DEBUG_FILE="$OUT_DIR/$NAME-debug.txt"
+
+    PASSES=$(sed -n 's|^// PASSES: *||p' $INPUT_FILE)
+    FLAGS=$(sed -n 's|^// FLAGS: *||p' $INPUT_FILE)
+    if [ -z "$PASSES" ]; then
+        PASSES="mem2reg"
+    fi
+
+    $CLANG -O0 -Xclang -disable-O0-optnone -fno-discard-value-names -S -emit-llvm $INPUT_FILE -o $LL_INPUT
+    if [ $? -ne 0 ]; then
+        fail "LLVM IR generation failed."
+        continue
+    fi
+
+    $OPT -S -passes=$PASSES $LL_INPUT -o $LL_INPUT
+    if [ $? -ne 0 ]; then
+        fail "$PASSES failed."
+        continue
+    fi
+
+    rm -f $REMARKS
+    $OPT -load-pass-plugin $PLUGIN_PATH -passes="fusion-pass,verify<domtree>,verify" $FLAGS -pass-remarks-output=$REMARKS \
+        -debug -S $LL_INPUT -o $LL_OUTPUT 2> $DEBUG_FILE
+    if [ $? -ne 0 ]; then
+        fail "Fusion pass failed, check $DEBUG_FILE for details."
+        continue
+    fi
+
+    $CLANG -O0 $LL_INPUT -o $EXE_INPUT && $CLANG -O0 $LL_OUTPUT -o $EXE_OUTPUT
+    if [ $? -ne 0 ]; then
+        fail "Program compilation failed."
+        continue
+    fi
+
+    ./$EXE_INPUT > $OUT_DIR/$NAME-res-input.txt
+    ./$EXE_OUTPUT > $OUT_DIR/$NAME-res-output.txt
+    if ! diff $OUT_DIR/$NAME-res-input.txt $OUT_DIR/$NAME-res-output.txt > $OUT_DIR/$NAME-diff.txt; then
+        fail "The outputs differ, check $OUT_DIR/$NAME-diff.txt for details."
+    fi
+    rm $EXE_INPUT $EXE_OUTPUT
+
+    REMARK_LIST=$(remarks $REMARKS)
+
+    while read FN COUNT; do
+        FOUND=$(echo "$REMARK_LIST" | grep -c "^Fused $FN\$")
+        if [ "$FOUND" -ne "$COUNT" ]; then
+            fail "$FN: expected $COUNT fusions, got $FOUND."
+        fi
+    done < <(sed -n 's|^// FUSED: *||p' $INPUT_FILE)
+
+    while read FN REMARK; do
+        if ! echo "$REMARK_LIST" | grep -q "^$REMARK $FN\$"; then
+            fail "$FN: expected a $REMARK remark."
+        fi
+    done < <(sed -n 's|^// MISSED: *||p' $INPUT_FILE)
+
+    while read FN COUNT PATTERN; do
+        FOUND=$(function_ir $LL_OUTPUT $FN | grep -c -E -- "$PATTERN")
+        if [ "$FOUND" -ne "$COUNT" ]; then
+            fail "$FN: expected $COUNT lines matching '$PATTERN', got $FOUND."
+        fi
+    done < <(sed -n 's|^// IR-COUNT: *||p' $INPUT_FILE)
+done
+
+if [ $FAILED -eq 0 ]; then
+    echo "Test passed: All regression tests passed."
+else
+    echo "Test failed: $FAILED checks failed."
+    exit 1
+fi
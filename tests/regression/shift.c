@@ -0,0 +1,75 @@
+/* Shifted fusion: a backward dependence of distance 1 is fused with L2 one iteration behind, distance 8 exceeds
+   -max-fusion-shift. A sum continued by the second loop is chained, a recurrence that is not a matching reduction is
+   refused */
+// FUSED: shift_near 1
+// MISSED: shift_far Dependence
+// FUSED: chain_sum 1
+// MISSED: chain_recurrence Recurrence
+#include <stdio.h>
+
+#define N 64
+
+int a[N + 8], b[N], c[N];
+
+void
+shift_near(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] + 1;
+	for (int i = 0; i < N; i++)
+		c[i] = a[i + 1] * 2;
+}
+
+void
+shift_far(void)
+{
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] - 1;
+	for (int i = 0; i < N; i++)
+		c[i] = a[i + 8] * 3;
+}
+
+int
+chain_sum(void)
+{
+	int s = 0;
+	for (int i = 0; i < N; i++)
+		s += a[i];
+	for (int i = 0; i < N; i++)
+		s += a[i] * b[i];
+	return s;
+}
+
+unsigned
+chain_recurrence(void)
+{
+	unsigned s = 1;
+	for (int i = 0; i < N; i++)
+		s = s * 2 + a[i];
+	for (int i = 0; i < N; i++)
+		s ^= a[i] + b[i];
+	return s;
+}
+
+static void
+print(void)
+{
+	unsigned long s = 0;
+	for (int i = 0; i < N; i++)
+		s = s * 31 + a[i] * 7 + c[i];
+	printf("%lu\n", s);
+}
+
+int
+main(void)
+{
+	for (int i = 0; i < N + 8; i++)
+		a[i] = 100 + i;
+	for (int i = 0; i < N; i++)
+		b[i] = 3 * i;
+	shift_near(); print();
+	shift_far(); print();
+	printf("%d\n", chain_sum());
+	printf("%u\n", chain_recurrence());
+	return 0;
+}
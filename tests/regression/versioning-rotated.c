@@ -0,0 +1,50 @@
+/* Runtime checks on rotated loops: the fallback copy of L2 is dominated by the exiting block of the L1 copy, not by
+   its header */
+// PASSES: mem2reg,loop-simplify,lcssa,loop-rotate
+// FLAGS: -fusion-versioning -max-fusion-shift=0 -fusion-vectorization=ignore -verify-dom-info
+// FUSED: version_rotated 1
+#include <stdio.h>
+
+#define N 64
+
+int a[N + 8], b[N + 8], t[N];
+
+void
+version_rotated(int *p, int *q, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = t[i] + i * 3;
+	for (int i = 0; i < n; i++)
+		t[i] = q[i + 1] + 1;
+}
+
+static void
+reset(void)
+{
+	for (int i = 0; i < N + 8; i++)
+	{
+		a[i] = i;
+		b[i] = 2 * i + 1;
+	}
+}
+
+static void
+print(void)
+{
+	unsigned long s = 0;
+	for (int i = 0; i < N + 8; i++)
+		s = s * 31 + a[i] * 7 + b[i];
+	for (int i = 0; i < N; i++)
+		s = s * 31 + t[i];
+	printf("%lu\n", s);
+}
+
+int
+main(void)
+{
+	/* Disjoint objects take the fused loop, overlapping ones the fallback */
+	reset(); version_rotated(a, b, N); print();
+	reset(); version_rotated(a, a, N); print();
+	reset(); version_rotated(a, b, 0); print();
+	return 0;
+}
@@ -0,0 +1,72 @@
+/* Runtime checks: pairs blocked by may-alias dependences between different objects or by unequal symbolic trip
+   counts are fused behind checks, a dependence within one object is not */
+// FLAGS: -fusion-versioning -max-fusion-shift=0
+// FUSED: version_alias 1
+// FUSED: version_trip 1
+// MISSED: version_same_object Dependence
+#include <stdio.h>
+
+#define N 64
+
+int a[N + 8], b[N + 8], t[N];
+
+void
+version_alias(int *p, int *q, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = t[i] + i * 3;
+	for (int i = 0; i < n; i++)
+		t[i] = q[i + 1] + 1;
+}
+
+void
+version_trip(int *p, int *q, int n, int m)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = p[i] + t[i];
+	for (int i = 0; i < m; i++)
+		q[i] = q[i] * 2 + t[i];
+}
+
+void
+version_same_object(int *p, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = i * 5;
+	for (int i = 0; i < n; i++)
+		t[i] = p[i + 1] - 1;
+}
+
+static void
+reset(void)
+{
+	for (int i = 0; i < N + 8; i++)
+	{
+		a[i] = i;
+		b[i] = 2 * i + 1;
+	}
+}
+
+static void
+print(void)
+{
+	unsigned long s = 0;
+	for (int i = 0; i < N + 8; i++)
+		s = s * 31 + a[i] * 7 + b[i];
+	for (int i = 0; i < N; i++)
+		s = s * 31 + t[i];
+	printf("%lu\n", s);
+}
+
+int
+main(void)
+{
+	/* Disjoint objects take the fused loop, overlapping ones the fallback */
+	reset(); version_alias(a, b, N); print();
+	reset(); version_alias(a, a, N); print();
+	reset(); version_trip(a, b, N, N); print();
+	reset(); version_trip(a, b, N, N - 5); print();
+	reset(); version_trip(a, a + 2, N, N); print();
+	reset(); version_same_object(a, N); print();
+	return 0;
+}
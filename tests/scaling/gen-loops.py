@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""Generates LLVM IR functions made of sibling loop nests for compile time scaling runs of fusion-pass.
+
+Every loop nest writes its own global array and reads arrays of earlier nests or inputs. A read of an earlier
+output at the same index is a dependence fusion keeps, with probability --dep-density the read is one element
+ahead instead, which blocks plain fusion. --between instructions are placed between neighbouring nests."""
+
+import argparse
+import random
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--functions", type=int, default=1, help="functions in the module")
+    parser.add_argument("--loops", type=int, default=16, help="sibling loop nests per function")
+    parser.add_argument("--depth", type=int, default=1, help="depth of every loop nest")
+    parser.add_argument("--body", type=int, default=4, help="arithmetic instructions in every innermost body")
+    parser.add_argument("--dep-density", type=float, default=0.1, help="probability of a fusion preventing dependence")
+    parser.add_argument("--between", type=int, default=0, help="instructions between neighbouring loop nests")
+    parser.add_argument("--inputs", type=int, default=4, help="input arrays per function")
+    parser.add_argument("--trip", type=int, default=64, help="trip count of every loop")
+    parser.add_argument("--seed", type=int, default=1, help="random seed")
+    parser.add_argument("-o", "--output", help="output file, stdout by default")
+    return parser.parse_args()
+
+
+class Function:
+    def __init__(self, name, args, rng):
+        self.name = name
+        self.args = args
+        self.rng = rng
+        self.lines = []
+        self.counter = 0
+
+    def tmp(self, hint):
+        self.counter += 1
+        return "%%%s%d" % (hint, self.counter)
+
+    def emit(self, line):
+        self.lines.append("  " + line)
+
+    def label(self, name):
+        self.lines.append("%s:" % name)
+
+    def element(self, array, indices, offset=0):
+        """Address of array[flattened indices + offset]"""
+        args = self.args
+        linear = indices[0]
+        for index in indices[1:]:
+            scaled = self.tmp("mul")
+            self.emit("%s = mul nuw nsw i64 %s, %d" % (scaled, linear, args.trip))
+            added = self.tmp("lin")
+            self.emit("%s = add nuw nsw i64 %s, %s" % (added, scaled, index))
+            linear = added
+        if offset:
+            shifted = self.tmp("off")
+            self.emit("%s = add nuw nsw i64 %s, %d" % (shifted, linear, offset))
+            linear = shifted
+        address = self.tmp("addr")
+        self.emit("%s = getelementptr inbounds [%d x double], ptr %s, i64 0, i64 %s"
+                  % (address, args.trip ** args.depth + 1, array, linear))
+        return address
+
+    def body(self, nest, indices, sources):
+        args = self.args
+        source, offset = sources[0]
+        value = self.tmp("v")
+        self.emit("%s = load double, ptr %s" % (value, self.element(source, indices, offset)))
+        for op in range(args.body):
+            result = self.tmp("v")
+            if op % 3 == 2 and len(sources) > 1:
+                other, other_offset = sources[1 + op % (len(sources) - 1)]
+                loaded = self.tmp("v")
+                self.emit("%s = load double, ptr %s" % (loaded, self.element(other, indices, other_offset)))
+                self.emit("%s = fadd double %s, %s" % (result, value, loaded))
+            elif op % 2:
+                self.emit("%s = fmul double %s, %s" % (result, value, "1.000000e+00"))
+            else:
+                self.emit("%s = fadd double %s, %s" % (result, value, "2.000000e+00"))
+            value = result
+        self.emit("store double %s, ptr %s" % (value, self.element("@out.%s.%d" % (self.name, nest), indices)))
+
+    def loop(self, nest, level, indices, sources, entry, exit):
+        """Emits a loop in loop simplify form, entered from the already open block entry"""
+        prefix = "l%d.%d" % (nest, level)
+        index = "%%i.%d.%d" % (nest, level)
+        self.emit("br label %%%s.header" % prefix)
+        self.label("%s.header" % prefix)
+        self.emit("%s = phi i64 [ 0, %%%s ], [ %s.next, %%%s.latch ]" % (index, entry, index, prefix))
+        condition = self.tmp("cmp")
+        self.emit("%s = icmp ult i64 %s, %d" % (condition, index, self.args.trip))
+        self.emit("br i1 %s, label %%%s.body, label %%%s" % (condition, prefix, exit))
+        self.label("%s.body" % prefix)
+        if level + 1 < self.args.depth:
+            inner_exit = "l%d.%d.exit" % (nest, level + 1)
+            self.loop(nest, level + 1, indices + [index], sources, "%s.body" % prefix, inner_exit)
+            self.label(inner_exit)
+        else:
+            self.body(nest, indices + [index], sources)
+        self.emit("br label %%%s.latch" % prefix)
+        self.label("%s.latch" % prefix)
+        self.emit("%s.next = add nuw nsw i64 %s, 1" % (index, index))
+        self.emit("br label %%%s.header" % prefix)
+
+    def between(self, nest):
+        if not self.args.between:
+            return
+        if self.args.between == 1:
+            self.emit("store i64 %d, ptr @acc.%s" % (nest, self.name))
+            return
+        value = self.tmp("s")
+        self.emit("%s = load i64, ptr @acc.%s" % (value, self.name))
+        for op in range(self.args.between - 2):
+            result = self.tmp("s")
+            self.emit("%s = add i64 %s, %d" % (result, value, nest + op + 1))
+            value = result
+        self.emit("store i64 %s, ptr @acc.%s" % (value, self.name))
+
+    def generate(self):
+        args, rng = self.args, self.rng
+        inputs = ["@in.%s.%d" % (self.name, t) for t in range(args.inputs)]
+        self.lines.append("define void @%s() {" % self.name)
+        self.label("entry")
+        block = "entry"
+        for nest in range(args.loops):
+            sources = []
+            for _ in range(2):
+                if nest and rng.random() < args.dep_density:
+                    sources.append(("@out.%s.%d" % (self.name, rng.randrange(nest)), 1))
+                elif nest and rng.random() < 0.5:
+                    sources.append(("@out.%s.%d" % (self.name, rng.randrange(nest)), 0))
+                else:
+                    sources.append((rng.choice(inputs), 0))
+            exit = "l%d.0.exit" % nest
+            self.loop(nest, 0, [], sources, block, exit)
+            self.label(exit)
+            self.between(nest)
+            block = exit
+        self.emit("ret void")
+        self.lines.append("}")
+        return inputs
+
+
+def main():
+    args = parse_args()
+    rng = random.Random(args.seed)
+    elements = args.trip ** args.depth + 1
+
+    globals_ = []
+    functions = []
+    for f in range(args.functions):
+        function = Function("f%d" % f, args, rng)
+        inputs = function.generate()
+        for array in inputs + ["@out.%s.%d" % (function.name, nest) for nest in range(args.loops)]:
+            globals_.append("%s = global [%d x double] zeroinitializer" % (array, elements))
+        if args.between:
+            globals_.append("@acc.%s = global i64 0" % function.name)
+        functions.append("\n".join(function.lines))
+
+    text = "\n".join(globals_) + "\n\n" + "\n\n".join(functions) + "\n"
+    if args.output:
+        with open(args.output, "w") as out:
+            out.write(text)
+    else:
+        print(text, end="")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""Runs opt -passes=fusion-pass on IR from gen-loops.py and records wall time and peak RSS per configuration.
+
+Each sweep varies one generator parameter of the base configuration. The same IR is also run through
+-passes=verify, so parsing and printing can be told apart from the pass itself. Results go to a CSV file."""
+
+import argparse
+import csv
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BASE = {"loops": 32, "depth": 1, "body": 4, "dep-density": 0.1, "between": 0}
+
+SWEEPS = {
+    "loops": [8, 16, 32, 64, 128, 256, 512],
+    "depth": [1, 2, 3],
+    "body": [4, 16, 64],
+    "dep-density": [0.0, 0.25, 0.5, 1.0],
+    "between": [0, 4, 16],
+}
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--opt", required=True, help="opt binary")
+    parser.add_argument("--plugin", required=True, help="libfusion-pass.so")
+    parser.add_argument("--output", default="scaling.csv", help="CSV file")
+    parser.add_argument("--runs", type=int, default=3, help="runs per configuration, the median time is reported")
+    parser.add_argument("--sweep", action="append", choices=sorted(SWEEPS), help="sweeps to run, all by default")
+    parser.add_argument("--opt-flag", action="append", default=[],
+                        help="extra opt flag, e.g. --opt-flag=-fusion-max-set-size=0")
+    return parser.parse_args()
+
+
+def measure(command):
+    """Wall seconds and peak RSS in KiB of one run"""
+    # A file instead of a pipe: opt writing more than the pipe buffer would block before wait4 returns
+    with tempfile.TemporaryFile() as stderr:
+        start = time.perf_counter()
+        process = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=stderr)
+        _, status, usage = os.wait4(process.pid, 0)
+        elapsed = time.perf_counter() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+        stderr.seek(0)
+        errors = stderr.read().decode(errors="replace")
+    if process.returncode != 0:
+        sys.exit("%s failed:\n%s" % (" ".join(command), errors))
+    return elapsed, usage.ru_maxrss
+
+
+def run(command, runs):
+    results = [measure(command) for _ in range(runs)]
+    return statistics.median(r[0] for r in results), max(r[1] for r in results)
+
+
+def main():
+    args = parse_args()
+    generator = os.path.join(os.path.dirname(os.path.abspath(__file__)), "gen-loops.py")
+    fields = list(BASE) + ["instructions", "fusion_seconds", "fusion_rss_kb", "verify_seconds", "verify_rss_kb"]
+
+    with tempfile.TemporaryDirectory() as tmp, open(args.output, "w", newline="") as out:
+        writer = csv.writer(out)
+        writer.writerow(fields)
+        for sweep in args.sweep or list(SWEEPS):
+            for value in SWEEPS[sweep]:
+                config = dict(BASE, **{sweep: value})
+                ir = os.path.join(tmp, "input.ll")
+                subprocess.run([sys.executable, generator, "-o", ir]
+                               + ["--%s=%s" % (key, val) for key, val in config.items()], check=True)
+                with open(ir) as f:
+                    instructions = sum(1 for line in f if line.startswith("  "))
+
+                fusion = run([args.opt, "-load-pass-plugin", args.plugin, "-passes=fusion-pass", "-disable-output"]
+                             + args.opt_flag + [ir], args.runs)
+                verify = run([args.opt, "-passes=verify", "-disable-output", ir], args.runs)
+
+                row = list(config.values()) + [instructions, "%.4f" % fusion[0], fusion[1], "%.4f" % verify[0], verify[1]]
+                writer.writerow(row)
+                out.flush()
+                print(",".join(str(v) for v in row), flush=True)
+
+
+if __name__ == "__main__":
+    main()